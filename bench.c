@@ -0,0 +1,126 @@
+/*
+================================================================================
+
+    Simple Code to run "bench.lua" with all modules built
+    written by Sebastian Steinhauer <s.steinhauer@yahoo.de>
+
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org/>
+
+================================================================================
+*/
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+LUALIB_API int luaopen_base64(lua_State *L);
+LUALIB_API int luaopen_json(lua_State *L);
+LUALIB_API int luaopen_msgpack(lua_State *L);
+
+
+typedef struct allocs_t {
+    lua_Integer             count, bytes;
+} allocs_t;
+
+
+static void *count_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    allocs_t                *allocs = (allocs_t*)ud;
+    (void)osize;
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    allocs->count++;
+    allocs->bytes += (lua_Integer)nsize;
+    return realloc(ptr, nsize);
+}
+
+
+static int f_clock(lua_State *L) {
+    struct timespec         ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lua_pushinteger(L, (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec);
+    return 1;
+}
+
+
+static int f_allocs(lua_State *L) {
+    allocs_t                *allocs = (allocs_t*)lua_touserdata(L, lua_upvalueindex(1));
+    lua_pushinteger(L, allocs->count);
+    lua_pushinteger(L, allocs->bytes);
+    return 2;
+}
+
+
+static int run_code(lua_State *L) {
+    if (luaL_loadfile(L, "bench.lua") != LUA_OK)
+        lua_error(L);
+    lua_call(L, 0, 0);
+    return 0;
+}
+
+
+int main() {
+    lua_State               *L;
+    allocs_t                allocs = { 0, 0 };
+    int                     status;
+
+    L = lua_newstate(count_alloc, &allocs);
+    if (L == NULL)
+        return 1;
+    luaL_openlibs(L);
+
+    luaL_requiref(L, "base64", luaopen_base64, 1);
+    luaL_requiref(L, "json", luaopen_json, 1);
+    luaL_requiref(L, "msgpack", luaopen_msgpack, 1);
+    lua_pop(L, 3);
+
+    /* helpers for bench.lua */
+    lua_newtable(L);
+    lua_pushcfunction(L, f_clock);
+    lua_setfield(L, -2, "clock");
+    lua_pushlightuserdata(L, &allocs);
+    lua_pushcclosure(L, f_allocs, 1);
+    lua_setfield(L, -2, "allocs");
+    lua_setglobal(L, "bench");
+
+    lua_getglobal(L, "debug");
+    lua_getfield(L, -1, "traceback");
+    lua_remove(L, -2);
+
+    lua_pushcfunction(L, run_code);
+    status = lua_pcall(L, 0, 0, -2);
+    if (status != LUA_OK)
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+
+    lua_close(L);
+    return status == LUA_OK ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+--------------------------------------------------------------------------------
+-- Benchmark for all modules, run by bench.c
+-- Prints one tab separated line per benchmark:
+--   module  case  op  bytes  iterations  ns_per_op  mb_per_s  allocs_per_op
+--------------------------------------------------------------------------------
+local base64 = require('base64')
+local json = require('json')
+local msgpack = require('msgpack')
+
+local clock, allocs = bench.clock, bench.allocs
+local MIN_TIME = 200 * 1000 * 1000 -- run every benchmark at least 200ms
+
+
+--------------------------------------------------------------------------------
+-- deterministic pseudo random numbers (independent of the Lua version)
+local seed = 42
+local function random(n)
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return seed % n
+end
+
+
+local function random_word(min, max)
+    local chars = {}
+    for i = 1, min + random(max - min + 1) do
+        chars[i] = string.char(97 + random(26))
+    end
+    return table.concat(chars)
+end
+
+
+local function random_text(words)
+    local text = {}
+    for i = 1, words do
+        text[i] = random_word(1, 10)
+    end
+    return table.concat(text, ' ')
+end
+
+
+--------------------------------------------------------------------------------
+-- corpus
+local function make_twitter()
+    local statuses = {}
+    for i = 1, 100 do
+        local hashtags = {}
+        for j = 1, random(4) do
+            hashtags[j] = { text = random_word(3, 12), indices = { random(140), random(140) } }
+        end
+        statuses[i] = {
+            id = 500000000000 + random(1000000),
+            created_at = 'Sun Aug 31 00:29:15 +0000 2014',
+            text = random_text(5 + random(15)) .. ' "quoted"\n',
+            source = '<a href="http://twitter.com" rel="nofollow">Twitter Web Client</a>',
+            truncated = false,
+            retweet_count = random(1000),
+            favorite_count = random(1000),
+            favorited = random(2) == 1,
+            lang = 'en',
+            user = {
+                id = random(100000000),
+                name = random_text(2),
+                screen_name = random_word(4, 15),
+                description = random_text(10 + random(10)),
+                followers_count = random(100000),
+                friends_count = random(5000),
+                verified = random(10) == 0,
+            },
+            entities = { hashtags = hashtags, urls = {}, user_mentions = {} },
+        }
+    end
+    return { statuses = statuses, search_metadata = { count = 100, max_id = 505874924095815681 } }
+end
+
+
+local function make_numeric()
+    local numbers = {}
+    for i = 1, 10000 do
+        if i % 2 == 0 then
+            numbers[i] = random(2000000) - 1000000
+        else
+            numbers[i] = (random(3600000) - 1800000) / 10000
+        end
+    end
+    return numbers
+end
+
+
+local function make_strings()
+    local strings = {}
+    for i = 1, 1000 do
+        strings[i] = random_text(2 + random(30)) .. (i % 10 == 0 and '\t"escaped"\\' or '')
+    end
+    return strings
+end
+
+
+local function make_nested()
+    local value = { leaf = true }
+    for i = 1, 100 do
+        value = { depth = i, child = value, list = { i, i + 1 } }
+    end
+    return value
+end
+
+
+local function make_small()
+    local messages = {}
+    for i = 1, 1000 do
+        messages[i] = { id = i, op = 'get', key = 'key:' .. random_word(4, 8) }
+    end
+    return messages
+end
+
+
+--------------------------------------------------------------------------------
+-- measurement
+local function measure(module, case, op, bytes, func)
+    local iterations, elapsed = 0, 0
+    local count, start_count
+    collectgarbage()
+    start_count = allocs()
+    repeat
+        local start = clock()
+        func()
+        elapsed = elapsed + (clock() - start)
+        iterations = iterations + 1
+    until elapsed >= MIN_TIME
+    count = allocs() - start_count
+    print(string.format('%s\t%s\t%s\t%d\t%d\t%.1f\t%.2f\t%.1f',
+        module, case, op, bytes, iterations,
+        elapsed / iterations,
+        (bytes * iterations / 1000000) / (elapsed / 1000000000),
+        count / iterations))
+end
+
+
+-- single documents are run as is, message lists are encoded one by one
+local function run_case(case, value, messages)
+    local codecs = {
+        { 'json', json.encode, json.decode },
+        { 'msgpack', msgpack.encode, msgpack.decode },
+    }
+    for _, codec in ipairs(codecs) do
+        local name, encode, decode = codec[1], codec[2], codec[3]
+        if messages then
+            local encoded, bytes = {}, 0
+            for i, message in ipairs(value) do
+                encoded[i] = assert(encode(message))
+                bytes = bytes + #encoded[i]
+            end
+            measure(name, case, 'encode', bytes, function()
+                for i = 1, #value do encode(value[i]) end
+            end)
+            measure(name, case, 'decode', bytes, function()
+                for i = 1, #encoded do decode(encoded[i]) end
+            end)
+        else
+            local encoded = assert(encode(value))
+            assert(decode(encoded))
+            measure(name, case, 'encode', #encoded, function() encode(value) end)
+            measure(name, case, 'decode', #encoded, function() decode(encoded) end)
+        end
+    end
+
+    -- direct transcoding between both formats and decoding with the collector paused
+    if not messages then
+        local text, binary = assert(json.encode(value)), assert(msgpack.encode(value))
+        local options = { gc = 'pause' }
+        measure('json', case, 'to_msgpack', #text, function() json.to_msgpack(text) end)
+        measure('msgpack', case, 'to_json', #binary, function() msgpack.to_json(binary) end)
+        measure('json', case, 'decode_gc', #text, function() json.decode(text, options) end)
+        measure('msgpack', case, 'decode_gc', #binary, function() msgpack.decode(binary, nil, nil, options) end)
+    end
+
+    -- base64 of the messagepack representation
+    local binary = messages and assert(msgpack.encode(table.unpack(value))) or assert(msgpack.encode(value))
+    local encoded = base64.encode(binary)
+    assert(base64.decode(encoded) == binary)
+    measure('base64', case, 'encode', #binary, function() base64.encode(binary) end)
+    measure('base64', case, 'decode', #encoded, function() base64.decode(encoded) end)
+end
+
+
+--------------------------------------------------------------------------------
+print('module\tcase\top\tbytes\titerations\tns_per_op\tmb_per_s\tallocs_per_op')
+run_case('twitter', make_twitter())
+run_case('numeric', make_numeric())
+run_case('strings', make_strings())
+run_case('nested', make_nested())
+run_case('small', make_small(), true)
+
+
+--------------------------------------------------------------------------------
+-- one large document, where pausing the collector should pay off
+do
+    local records = {}
+    for i = 1, 50000 do
+        records[i] = { id = i, name = random_word(3, 12), score = random(1000) / 4, tags = { random_word(3, 8), random_word(3, 8) } }
+    end
+    local text, binary = assert(json.encode(records)), assert(msgpack.encode(records))
+    local options = { gc = 'pause' }
+    measure('json', 'large', 'decode', #text, function() json.decode(text) end)
+    measure('json', 'large', 'decode_gc', #text, function() json.decode(text, options) end)
+    measure('msgpack', 'large', 'decode', #binary, function() msgpack.decode(binary) end)
+    measure('msgpack', 'large', 'decode_gc', #binary, function() msgpack.decode(binary, nil, nil, options) end)
+end
@@ -0,0 +1,252 @@
+/*
+================================================================================
+
+    Multi-state stress harness, runs "stress.lua" in one Lua state per thread
+    written by Sebastian Steinhauer <s.steinhauer@yahoo.de>
+
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <http://unlicense.org/>
+
+================================================================================
+*/
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+#define MAX_THREADS         64
+#define MIN_EFFICIENCY      0.5
+
+
+LUALIB_API int luaopen_base64(lua_State *L);
+LUALIB_API int luaopen_json(lua_State *L);
+LUALIB_API int luaopen_msgpack(lua_State *L);
+
+
+/* every worker owns one Lua state, nothing else is shared except the start gate */
+typedef struct worker_t {
+    pthread_t               thread, owner;
+    int                     running;
+    const char              *reference;
+    lua_Integer             rounds, foreign;
+    char                    error[256];
+} worker_t;
+
+
+typedef struct gate_t {
+    pthread_mutex_t         mutex;
+    pthread_cond_t          cond;
+    int                     ready, open;
+    lua_Integer             deadline;
+} gate_t;
+
+
+static gate_t               gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+
+
+static lua_Integer clock_ns(void) {
+    struct timespec         ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* counts allocations of a state made from any other thread than its owner */
+static void *worker_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    worker_t                *worker = (worker_t*)ud;
+    (void)osize;
+    if (!pthread_equal(pthread_self(), worker->owner))
+        worker->foreign++;
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsize);
+}
+
+
+/* creates a state with all modules and pushes the function returned by stress.lua */
+static lua_State *worker_state(worker_t *worker) {
+    lua_State               *L;
+
+    worker->owner = pthread_self();
+    if ((L = lua_newstate(worker_alloc, worker)) == NULL) {
+        snprintf(worker->error, sizeof(worker->error), "cannot create Lua state");
+        return NULL;
+    }
+    luaL_openlibs(L);
+    luaL_requiref(L, "base64", luaopen_base64, 1);
+    luaL_requiref(L, "json", luaopen_json, 1);
+    luaL_requiref(L, "msgpack", luaopen_msgpack, 1);
+    lua_pop(L, 3);
+    if ((luaL_loadfile(L, "stress.lua") != LUA_OK) || (lua_pcall(L, 0, 1, 0) != LUA_OK)) {
+        snprintf(worker->error, sizeof(worker->error), "%s", lua_tostring(L, -1));
+        lua_close(L);
+        return NULL;
+    }
+    return L;
+}
+
+
+/* runs one round, the digest is left on the stack. Returns 0 on errors */
+static int worker_round(worker_t *worker, lua_State *L) {
+    lua_settop(L, 1);
+    lua_pushvalue(L, 1);
+    if (lua_pcall(L, 0, 1, 0) != LUA_OK) {
+        snprintf(worker->error, sizeof(worker->error), "%s", lua_tostring(L, -1));
+        return 0;
+    }
+    if ((worker->reference != NULL) && (strcmp(lua_tostring(L, -1), worker->reference) != 0)) {
+        snprintf(worker->error, sizeof(worker->error), "digest mismatch: %s", lua_tostring(L, -1));
+        return 0;
+    }
+    worker->rounds++;
+    return 1;
+}
+
+
+static void *worker_main(void *arg) {
+    worker_t                *worker = (worker_t*)arg;
+    lua_State               *L = worker_state(worker);
+    lua_Integer             deadline;
+
+    /* one round before the start, so loading the corpus is not measured */
+    if ((L != NULL) && worker_round(worker, L))
+        worker->rounds = 0;
+
+    pthread_mutex_lock(&gate.mutex);
+    gate.ready++;
+    pthread_cond_broadcast(&gate.cond);
+    while (!gate.open)
+        pthread_cond_wait(&gate.cond, &gate.mutex);
+    deadline = gate.deadline;
+    pthread_mutex_unlock(&gate.mutex);
+
+    if (L != NULL) {
+        while ((worker->error[0] == 0) && (clock_ns() < deadline))
+            worker_round(worker, L);
+        lua_close(L);
+    }
+    return NULL;
+}
+
+
+/* runs the workload on count threads for duration ns, returns the total rounds or -1 on errors */
+static lua_Integer run_threads(worker_t *workers, int count, const char *reference, lua_Integer duration) {
+    lua_Integer             rounds = 0, foreign = 0;
+    int                     i, failed = 0;
+
+    gate.ready = gate.open = 0;
+    for (i = 0; i < count; ++i) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].reference = reference;
+        workers[i].running = (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) == 0);
+        if (!workers[i].running) {
+            fprintf(stderr, "cannot create thread %d\n", i + 1);
+            count = i;
+            failed = 1;
+        }
+    }
+
+    pthread_mutex_lock(&gate.mutex);
+    while (gate.ready < count)
+        pthread_cond_wait(&gate.cond, &gate.mutex);
+    gate.deadline = clock_ns() + duration;
+    gate.open = 1;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.mutex);
+
+    for (i = 0; i < count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].error[0] != 0) {
+            fprintf(stderr, "thread %d: %s\n", i + 1, workers[i].error);
+            failed = 1;
+        }
+        rounds += workers[i].rounds;
+        foreign += workers[i].foreign;
+    }
+    if (foreign > 0) {
+        fprintf(stderr, "%d threads: %ld allocations from foreign threads\n", count, (long)foreign);
+        failed = 1;
+    }
+    return failed ? -1 : rounds;
+}
+
+
+int main(int argc, char **argv) {
+    static worker_t         workers[MAX_THREADS];
+    worker_t                main_worker;
+    lua_State               *L;
+    lua_Integer             duration, rounds, single = 0;
+    int                     max_threads, threads, status = 0;
+    double                  per_second, speedup;
+
+    max_threads = (argc > 1) ? atoi(argv[1]) : 8;
+    duration = (lua_Integer)(((argc > 2) ? atof(argv[2]) : 1.0) * 1000000000.0);
+    if ((max_threads < 1) || (max_threads > MAX_THREADS) || (duration <= 0)) {
+        fprintf(stderr, "usage: %s [max_threads (1..%d)] [seconds per step]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    /* the reference digest comes from a state on the main thread */
+    memset(&main_worker, 0, sizeof(main_worker));
+    if (((L = worker_state(&main_worker)) == NULL) || !worker_round(&main_worker, L)) {
+        fprintf(stderr, "%s\n", main_worker.error);
+        if (L != NULL)
+            lua_close(L);
+        return 1;
+    }
+
+    /* tab separated: threads  rounds  rounds_per_s  speedup  efficiency  flags */
+    for (threads = 1; ; threads *= 2) {
+        if (threads > max_threads)
+            threads = max_threads;
+        rounds = run_threads(workers, threads, lua_tostring(L, -1), duration);
+        if (rounds < 0) {
+            printf("%d\t-\t-\t-\t-\tFAILED\n", threads);
+            status = 1;
+        } else {
+            if (threads == 1)
+                single = rounds;
+            per_second = (double)rounds * 1000000000.0 / (double)duration;
+            speedup = (single > 0) ? (double)rounds / (double)single : 0.0;
+            printf("%d\t%ld\t%.1f\t%.2f\t%.2f\t%s\n", threads, (long)rounds, per_second, speedup, speedup / threads,
+                (speedup / threads < MIN_EFFICIENCY) ? "CONTENTION" : "ok");
+            fflush(stdout);
+        }
+        if (threads == max_threads)
+            break;
+    }
+
+    lua_close(L);
+    return status;
+}
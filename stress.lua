@@ -0,0 +1,105 @@
+--------------------------------------------------------------------------------
+-- Workload for the multi-state stress harness, run by stress.c
+-- Returns a function which runs one round of encode / decode loops with all
+-- modules, verifies the round trips and returns a digest of the outputs.
+-- Every state must return the same digest, so only outputs which do not
+-- depend on the (per state randomized) table iteration order are hashed.
+--------------------------------------------------------------------------------
+local base64 = require('base64')
+local json = require('json')
+local msgpack = require('msgpack')
+
+
+--------------------------------------------------------------------------------
+-- deterministic pseudo random numbers (independent of the Lua version)
+local seed = 42
+local function random(n)
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return seed % n
+end
+
+
+local function random_text(words)
+    local text = {}
+    for i = 1, words do
+        local chars = {}
+        for j = 1, 1 + random(10) do
+            chars[j] = string.char(97 + random(26))
+        end
+        text[i] = table.concat(chars)
+    end
+    return table.concat(text, ' ')
+end
+
+
+local function equal(a, b)
+    if type(a) ~= 'table' or type(b) ~= 'table' then
+        return a == b
+    end
+    for k, v in pairs(a) do
+        if not equal(v, b[k]) then return false end
+    end
+    for k in pairs(b) do
+        if a[k] == nil then return false end
+    end
+    return true
+end
+
+
+--------------------------------------------------------------------------------
+-- corpus
+local rows, records, numbers = {}, {}, {}
+for i = 1, 200 do
+    rows[i] = { i, random_text(1 + random(8)), random(100000) + 0.5, random(2) == 1, { random(1000), 'x\n"y"' } }
+    records[i] = { id = i, name = random_text(2), score = random(1000) / 4, tags = { random_text(1), random_text(1) } }
+end
+for i = 1, 5000 do
+    numbers[i] = (i % 2 == 0) and (random(2000000) - 1000000) or (random(1000000) / 8)
+end
+local text = random_text(2000)
+local record = msgpack.schema({ 'id', 'name', 'score', 'tags' }, { array = true })
+
+
+--------------------------------------------------------------------------------
+return function()
+    local digests = {}
+
+    -- JSON
+    local doc, digest = json.encode(rows, { hash = 'xxh64' })
+    assert(equal(json.decode(doc), rows), 'json round trip')
+    local many = json.decode_many({ doc, json.encode(numbers) })
+    assert(equal(many[1], rows) and equal(many[2], numbers), 'json.decode_many round trip')
+    assert(equal((msgpack.decode(json.to_msgpack(doc))), rows), 'json.to_msgpack')
+    digests[#digests + 1] = digest
+
+    -- messagepack
+    local binary
+    binary, digest = msgpack.encode_with({ hash = 'xxh64', size = msgpack.sizeof(rows, numbers) }, rows, numbers)
+    local a, b = msgpack.decode(binary)
+    assert(equal(a, rows) and equal(b, numbers), 'msgpack round trip')
+    assert(equal(json.decode((msgpack.to_json(binary))), rows), 'msgpack.to_json')
+    digests[#digests + 1] = digest
+
+    binary = record:encode(table.unpack(records))
+    local decoded = { record:decode(binary) }
+    assert(#decoded == #records + 1 and equal(decoded[#records], records[#records]), 'schema round trip')
+    digests[#digests + 1] = select(2, msgpack.encode_with({ hash = 'crc32c' }, binary))
+
+    local unpacker, position = msgpack.unpacker(), 1
+    while position <= #binary do
+        unpacker:feed(binary:sub(position, position + 999))
+        position = position + 1000
+    end
+    for i = 1, #records do
+        local ok, value = assert(unpacker:next())
+        assert(ok and value[1] == i, 'unpacker')
+    end
+
+    -- base64
+    local encoded = base64.encode(text)
+    assert(base64.decode(encoded) == text, 'base64 round trip')
+    assert(json.decode(json.encode(text, { encoding = 'base64' }), { encoding = 'base64' }) == text, 'json base64')
+    digests[#digests + 1] = select(2, msgpack.encode_with({ hash = 'crc32c' }, encoded))
+
+    return table.concat(digests, ' ')
+end
@@ -31,83 +31,309 @@
 
 ================================================================================
 */
+#if defined(BASE64_STATS) || defined(BASE64_THREADS)
+#define _POSIX_C_SOURCE 199309L
+#endif
+#ifdef BASE64_STATS
+#include <time.h>
+#endif
+#ifdef BASE64_THREADS
+#include <pthread.h>
+#endif
 #include <stdarg.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "lua.h"
 #include "lauxlib.h"
 
 
 #define BASE64_AUTHOR       "Sebastian Steinhauer <s.steinhauer@yahoo.de>"
-#define BASE64_VERSION      "1.0.0"
+#define BASE64_VERSION      "1.3.0"
+#define BASE64_MAX_THREADS  64
+#define BASE64_MIN_CHUNK    (1024 * 64)
 
+#ifdef BASE64_THREADS
+#define BASE64_DEFAULT_THREADS 4
+#define BASE64_PARALLEL_MIN (1024 * 1024 * 4)
+#endif
 
-static int f_encode(lua_State *L) {
-    static const char       *table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    luaL_Buffer buffer;
-    int value, bits;
-    size_t length, written;
-    const uint8_t *data = (const uint8_t*)luaL_checklstring(L, 1, &length);
-
-    luaL_buffinit(L, &buffer);
-    for (value = bits = 0, written = 0; length > 0; --length, ++data) {
-        value = (value << 8) | *data; bits += 8;
-        for (; bits >= 6; bits -= 6, ++written)
-            luaL_addchar(&buffer, table[(value >> (bits - 6)) & 63]);
+
+#ifdef BASE64_STATS
+/* counters are per thread, so every thread can run its own Lua state without locks */
+typedef struct stats_t {
+    lua_Integer             encode_calls, encode_ns;
+    lua_Integer             decode_calls, decode_ns;
+    lua_Integer             bytes_in, bytes_out, errors;
+} stats_t;
+
+
+/* _Thread_local is C11, older compilers have their own keyword */
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+static _Thread_local stats_t base64_stats;
+#elif defined(__GNUC__)
+static __thread stats_t base64_stats;
+#elif defined(_MSC_VER)
+static __declspec(thread) stats_t base64_stats;
+#else
+#error "BASE64_STATS requires thread local storage"
+#endif
+
+
+static lua_Integer stats_clock(void) {
+    struct timespec         ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+#define STATS_ADD(f, n)     (base64_stats.f += (lua_Integer)(n))
+#define STATS_BEGIN()       lua_Integer stats_start = stats_clock()
+#define STATS_END(op)       (base64_stats.op##_calls++, base64_stats.op##_ns += stats_clock() - stats_start)
+#else
+#define STATS_ADD(f, n)     ((void)0)
+#define STATS_BEGIN()       int stats_start = 0
+#define STATS_END(op)       ((void)stats_start)
+#endif
+
+
+/* keep the first two fields in sync with sts_msgpack.c */
+typedef struct view_t {
+    const char              *data;
+    size_t                  length;
+} view_t;
+
+
+/* accepts Lua strings and views created by sts_msgpack.c */
+static const char *check_data(lua_State *L, int arg, size_t *length) {
+    view_t                  *view = (view_t*)luaL_testudata(L, arg, "msgpack.view");
+    if (view != NULL) {
+        *length = view->length;
+        return view->data;
+    }
+    return luaL_checklstring(L, arg, length);
+}
+
+
+static const char           encode_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static const uint8_t        decode_table[256] = {
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 62, 65, 65, 65, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 65, 65, 65, 64, 65, 65,
+    65,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 65, 65, 65, 65, 65,
+    65, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65
+};
+
+
+/* a piece of the input which is converted into its own region of the output */
+typedef struct job_t {
+    const uint8_t           *input;
+    size_t                  length;
+    char                    *output;
+    size_t                  error; /* offset of the first invalid character */
+#ifdef BASE64_THREADS
+    pthread_t               thread;
+    int                     running;
+#endif
+} job_t;
+
+
+static void *encode_job(void *arg) {
+    job_t                   *job = (job_t*)arg;
+    const uint8_t           *data = job->input;
+    char                    *out = job->output;
+    size_t                  length = job->length;
+    uint32_t                value;
+
+    for (; length >= 3; length -= 3, data += 3, out += 4) {
+        value = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+        out[0] = encode_table[value >> 18];
+        out[1] = encode_table[(value >> 12) & 63];
+        out[2] = encode_table[(value >> 6) & 63];
+        out[3] = encode_table[value & 63];
     }
-    if (bits > 0) {
-        value <<= 8; bits += 8;
-        luaL_addchar(&buffer, table[(value >> (bits - 6)) & 63]);
-        ++written;
+    if (length > 0) { /* only the last job has a partial block */
+        value = ((uint32_t)data[0] << 16) | ((length > 1) ? ((uint32_t)data[1] << 8) : 0);
+        out[0] = encode_table[value >> 18];
+        out[1] = encode_table[(value >> 12) & 63];
+        out[2] = (length > 1) ? encode_table[(value >> 6) & 63] : '=';
+        out[3] = '=';
     }
-    for (; (written % 4) != 0; ++written)
-        luaL_addchar(&buffer, '=');
-    luaL_pushresult(&buffer);
+    return NULL;
+}
+
+
+static void *decode_job(void *arg) {
+    job_t                   *job = (job_t*)arg;
+    const uint8_t           *data = job->input;
+    char                    *out = job->output;
+    size_t                  i;
+    uint32_t                a, b, c, d, value;
+    int                     bits;
+
+    job->error = (size_t)-1;
+    for (i = 0; i + 4 <= job->length; i += 4, out += 3) {
+        a = decode_table[data[i]];
+        b = decode_table[data[i + 1]];
+        c = decode_table[data[i + 2]];
+        d = decode_table[data[i + 3]];
+        if ((a | b | c | d) > 63)
+            break;
+        value = (a << 18) | (b << 12) | (c << 6) | d;
+        out[0] = (char)(value >> 16);
+        out[1] = (char)((value >> 8) & 255);
+        out[2] = (char)(value & 255);
+    }
+
+    /* partial block of the last job or an invalid character */
+    for (value = 0, bits = 0; i < job->length; ++i) {
+        if ((a = decode_table[data[i]]) > 63) {
+            job->error = i;
+            break;
+        }
+        value = (value << 6) | a; bits += 6;
+        if (bits >= 8) {
+            *out++ = (char)((value >> (bits - 8)) & 255);
+            bits -= 8;
+        }
+    }
+    return NULL;
+}
+
+
+/* runs all jobs, the calling thread takes the first one */
+static void run_jobs(job_t *jobs, size_t count, void *(*func)(void*)) {
+    size_t                  i;
+#ifdef BASE64_THREADS
+    for (i = 1; i < count; ++i)
+        if (!(jobs[i].running = (pthread_create(&jobs[i].thread, NULL, func, &jobs[i]) == 0)))
+            func(&jobs[i]);
+    func(&jobs[0]);
+    for (i = 1; i < count; ++i)
+        if (jobs[i].running)
+            pthread_join(jobs[i].thread, NULL);
+#else
+    for (i = 0; i < count; ++i)
+        func(&jobs[i]);
+#endif
+}
+
+
+/* returns the amount of jobs for the given input length */
+static size_t check_threads(lua_State *L, int arg, size_t length) {
+    size_t                  threads;
+#ifdef BASE64_THREADS
+    threads = (size_t)luaL_optinteger(L, arg, (length >= BASE64_PARALLEL_MIN) ? BASE64_DEFAULT_THREADS : 1);
+#else
+    threads = (size_t)luaL_optinteger(L, arg, 1);
+#endif
+    luaL_argcheck(L, (threads >= 1) && (threads <= BASE64_MAX_THREADS), arg, "invalid number of threads");
+    if (threads > length / BASE64_MIN_CHUNK)
+        threads = length / BASE64_MIN_CHUNK;
+    return threads ? threads : 1;
+}
+
+
+static int f_encode(lua_State *L) {
+    luaL_Buffer             buffer;
+    job_t                   jobs[BASE64_MAX_THREADS];
+    size_t                  length, size, chunk, i, threads;
+    const uint8_t           *data = (const uint8_t*)check_data(L, 1, &length);
+    char                    *out;
+    STATS_BEGIN();
+
+    /* split the input on 3 byte blocks */
+    threads = check_threads(L, 2, length);
+    size = (length + 2) / 3 * 4;
+    chunk = length / 3 / threads * 3;
+    out = luaL_buffinitsize(L, &buffer, size);
+    for (i = 0; i < threads; ++i) {
+        jobs[i].input = data + i * chunk;
+        jobs[i].length = (i == threads - 1) ? (length - i * chunk) : chunk;
+        jobs[i].output = out + i * chunk / 3 * 4;
+    }
+    run_jobs(jobs, threads, encode_job);
+
+    STATS_ADD(bytes_in, length);
+    STATS_ADD(bytes_out, size);
+    luaL_pushresultsize(&buffer, size);
+    STATS_END(encode);
     return 1;
 }
 
 
 static int f_decode(lua_State *L) {
-    static const uint8_t    table[256] = {
-        65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-        65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 62, 65, 65, 65, 63, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 65, 65, 65, 64, 65, 65,
-        65,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 65, 65, 65, 65, 65,
-        65, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 65, 65, 65, 65, 65,
-        65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-        65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-        65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-        65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65
-    };
-    luaL_Buffer buffer;
-    size_t length;
-    int value, bits, code;
-    const uint8_t *data = (const uint8_t*)luaL_checklstring(L, 1, &length);
-
-    luaL_buffinit(L, &buffer);
-    for (value = bits = 0; length > 0; --length, ++data) {
-        code = table[*data];
-        if (code < 64) {
-            value = (value << 6) | code; bits += 6;
-        } else if (code == 64) {
-            break;
-        } else {
+    luaL_Buffer             buffer;
+    job_t                   jobs[BASE64_MAX_THREADS];
+    size_t                  length, size, chunk, i, threads;
+    const uint8_t           *data = (const uint8_t*)check_data(L, 1, &length);
+    const uint8_t           *padding;
+    char                    *out;
+    STATS_BEGIN();
+
+    /* everything behind the first padding character is ignored */
+    if ((padding = (const uint8_t*)memchr(data, '=', length)) != NULL)
+        length = (size_t)(padding - data);
+
+    /* split the input on 4 character blocks */
+    threads = check_threads(L, 2, length);
+    size = length / 4 * 3 + ((length % 4) * 6) / 8;
+    chunk = length / 4 / threads * 4;
+    out = luaL_buffinitsize(L, &buffer, size);
+    for (i = 0; i < threads; ++i) {
+        jobs[i].input = data + i * chunk;
+        jobs[i].length = (i == threads - 1) ? (length - i * chunk) : chunk;
+        jobs[i].output = out + i * chunk / 4 * 3;
+    }
+    run_jobs(jobs, threads, decode_job);
+
+    STATS_ADD(bytes_in, length);
+    for (i = 0; i < threads; ++i) {
+        if (jobs[i].error != (size_t)-1) {
             luaL_pushfail(L);
-            lua_pushliteral(L, "invalid base64 string");
+            lua_pushfstring(L, "invalid base64 character at position %I", (lua_Integer)(i * chunk + jobs[i].error + 1));
+            STATS_ADD(errors, 1);
+            STATS_END(decode);
             return 2;
         }
-        for (; bits >= 8; bits -= 8)
-            luaL_addchar(&buffer, (value >> (bits - 8)) & 255);
     }
-    for (; bits >= 8; bits -= 8)
-        luaL_addchar(&buffer, (value >> (bits - 8)) & 255);
-    luaL_pushresult(&buffer);
+    STATS_ADD(bytes_out, size);
+    luaL_pushresultsize(&buffer, size);
+    STATS_END(decode);
+    return 1;
+}
+
+
+#ifdef BASE64_STATS
+static int f_stats(lua_State *L) {
+    int                     reset = lua_toboolean(L, 1); /* read before the result is pushed */
+
+    lua_createtable(L, 0, 7);
+    lua_pushinteger(L, base64_stats.encode_calls); lua_setfield(L, -2, "encode_calls");
+    lua_pushinteger(L, base64_stats.encode_ns); lua_setfield(L, -2, "encode_ns");
+    lua_pushinteger(L, base64_stats.decode_calls); lua_setfield(L, -2, "decode_calls");
+    lua_pushinteger(L, base64_stats.decode_ns); lua_setfield(L, -2, "decode_ns");
+    lua_pushinteger(L, base64_stats.bytes_in); lua_setfield(L, -2, "bytes_in");
+    lua_pushinteger(L, base64_stats.bytes_out); lua_setfield(L, -2, "bytes_out");
+    lua_pushinteger(L, base64_stats.errors); lua_setfield(L, -2, "errors");
+    if (reset)
+        memset(&base64_stats, 0, sizeof(base64_stats));
     return 1;
 }
+#endif
 
 
 static const luaL_Reg       funcs[] = {
     { "encode",             f_encode        },
     { "decode",             f_decode        },
+#ifdef BASE64_STATS
+    { "stats",              f_stats         },
+#endif
     { "_VERSION",           NULL            },
     { "_AUTHOR",            NULL            },
     { NULL,                 NULL            }
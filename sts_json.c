@@ -31,9 +31,29 @@
 
 ================================================================================
 */
+#if defined(JSON_STATS) || defined(JSON_THREADS) || defined(JSON_MMAP)
+#define _POSIX_C_SOURCE 199309L
+#endif
+#ifdef JSON_STATS
+#include <time.h>
+#endif
+#ifdef JSON_THREADS
+#include <pthread.h>
+#endif
+#ifdef JSON_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <setjmp.h>
 #include <stdarg.h>
-#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "lua.h"
@@ -41,27 +61,229 @@
 
 
 #define JSON_AUTHOR         "Sebastian Steinhauer <s.steinhauer@yahoo.de>"
-#define JSON_VERSION        "0.2.0"
+#define JSON_VERSION        "0.14.0"
+#define JSON_BATCH          "json.batch"
+#define JSON_FILE           "json.file"
+#define JSON_F64            "json.f64"
+#define JSON_MAX_THREADS    64
+#define JSON_MAX_DEPTH      1000
+#define JSON_SMALL_INPUT    512
+#define JSON_SCRATCH_MAX    (1024 * 1024)
+#define JSON_GC             "json.gc"
+
+#ifdef JSON_THREADS
+#define JSON_DEFAULT_THREADS 4
+#else
+#define JSON_DEFAULT_THREADS 1
+#endif
+
+
+/* state of the hash option */
+enum { HASH_NONE, HASH_XXH64, HASH_CRC32C };
+
+
+typedef struct hash_t {
+    int                     type;
+    uint32_t                crc;
+    uint64_t                total;
+    uint64_t                acc[4];
+    uint8_t                 buffer[32];
+    size_t                  size;
+} hash_t;
 
 
 typedef struct json_t {
     lua_State               *L;
     jmp_buf                 jmp;
+    int                     depth;
+    int                     yield;
+    int                     base64;
+    int                     gc;
 
     /* decoder variables */
     const char              *input;
+    const char              *end;
+    int                     numeric;
 
     /* encoder variables */
     char                    output[1024 * 16];
     size_t                  position;
     int                     table, index;
+    hash_t                  hash;
 } json_t;
 
 
+/* containers of a resumable encode / decode */
+typedef struct frame_t {
+    int                     table, object, more;
+    lua_Integer             index;
+} frame_t;
+
+
+typedef struct resume_t {
+    json_t                  json;
+    int                     depth, top, value, done;
+    frame_t                 frames[JSON_MAX_DEPTH];
+} resume_t;
+
+
+/* tokens of a document decoded by a worker thread */
+enum {
+    TAPE_NULL, TAPE_FALSE, TAPE_TRUE, TAPE_NUMBER, TAPE_INTEGER,
+    TAPE_STRING, TAPE_ESCAPED, TAPE_ARRAY, TAPE_OBJECT
+};
+
+
+typedef struct token_t {
+    int                     type;
+    size_t                  length; /* items of arrays / objects, bytes of strings */
+    union {
+        lua_Number          number;
+        lua_Integer         integer;
+        size_t              offset; /* TAPE_STRING: input, TAPE_ESCAPED: strings */
+    } value;
+} token_t;
+
+
+typedef struct tape_t {
+    const char              *input;
+    size_t                  length;
+
+    /* output of the worker */
+    token_t                 *tokens;
+    size_t                  count, size;
+    char                    *strings;
+    size_t                  strings_length, strings_size;
+    char                    error[128];
+    int                     failed;
+} tape_t;
+
+
+/* contents of a file, mapped with JSON_MMAP otherwise read into memory */
+typedef struct file_t {
+    const char              *data;
+    size_t                  length;
+} file_t;
+
+
+/* packed array of numbers created by the numeric_arrays option */
+typedef struct f64_t {
+    size_t                  count;
+    double                  values[1];
+} f64_t;
+
+
+typedef struct batch_t {
+    size_t                  count;
+    tape_t                  tapes[1];
+} batch_t;
+
+
+/* keep the first two fields in sync with sts_msgpack.c */
+typedef struct view_t {
+    const char              *data;
+    size_t                  length;
+} view_t;
+
+
+#ifdef JSON_STATS
+/* counters are per thread, so every thread can run its own Lua state without locks */
+typedef struct stats_t {
+    lua_Integer             encode_calls, encode_ns;
+    lua_Integer             decode_calls, decode_ns;
+    lua_Integer             decode_file_calls, decode_file_ns;
+    lua_Integer             decode_many_calls, decode_many_ns;
+    lua_Integer             to_msgpack_calls, to_msgpack_ns;
+    lua_Integer             bytes_in, bytes_out, flushes;
+    lua_Integer             escaped, max_depth, errors;
+} stats_t;
+
+
+/* _Thread_local is C11, older compilers have their own keyword */
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+static _Thread_local stats_t json_stats;
+#elif defined(__GNUC__)
+static __thread stats_t json_stats;
+#elif defined(_MSC_VER)
+static __declspec(thread) stats_t json_stats;
+#else
+#error "JSON_STATS requires thread local storage"
+#endif
+
+
+static lua_Integer stats_clock(void) {
+    struct timespec         ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+#define STATS_ADD(f, n)     (json_stats.f += (lua_Integer)(n))
+#define STATS_ENTER(json)   ((++(json)->depth > json_stats.max_depth) ? (void)(json_stats.max_depth = (json)->depth) : (void)0)
+#define STATS_LEAVE(json)   (--(json)->depth)
+#define STATS_BEGIN()       lua_Integer stats_start = stats_clock()
+#define STATS_END(op)       (json_stats.op##_calls++, json_stats.op##_ns += stats_clock() - stats_start)
+#else
+#define STATS_ADD(f, n)     ((void)0)
+#define STATS_ENTER(json)   ((void)0)
+#define STATS_LEAVE(json)   ((void)0)
+#define STATS_BEGIN()       int stats_start = 0
+#define STATS_END(op)       ((void)stats_start)
+#endif
+
+
 static void decode_value(json_t *json);
 static void encode_value(json_t *json);
 
 
+/* character classes of the table driven decoder */
+enum {
+    CHAR_OTHER, CHAR_SPACE, CHAR_NUMBER, CHAR_STRING, CHAR_ARRAY, CHAR_ARRAY_END,
+    CHAR_OBJECT, CHAR_OBJECT_END, CHAR_COMMA, CHAR_COLON, CHAR_NULL, CHAR_TRUE, CHAR_FALSE
+};
+
+
+static const uint8_t        char_class[256] = {
+    /* 0x00 - 0x1f -> control characters, whitespace */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,  1,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0x20 - 0x3f -> whitespace, '"', ',', '-', digits, ':' */
+     1,  0,  3,  0,  0,  0,  0,  0,  0,  0,  0,  0,  8,  2,  0,  0,
+     2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  9,  0,  0,  0,  0,  0,
+    /* 0x40 - 0x5f -> '[', ']' */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  4,  0,  5,  0,  0,
+    /* 0x60 - 0x7f -> 'f', 'n', 't', '{', '}' */
+     0,  0,  0,  0,  0,  0, 12,  0,  0,  0,  0,  0,  0,  0, 10,  0,
+     0,  0,  0,  0, 11,  0,  0,  0,  0,  0,  0,  6,  0,  7,  0,  0,
+    /* 0x80 - 0xff -> no JSON syntax */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0
+};
+
+
+static int is_space(char ch) {
+    return char_class[(uint8_t)ch] == CHAR_SPACE;
+}
+
+
+/* accepts Lua strings and views created by sts_msgpack.c */
+static const char *check_data(lua_State *L, int arg, size_t *length) {
+    view_t                  *view = (view_t*)luaL_testudata(L, arg, "msgpack.view");
+    if (view != NULL) {
+        *length = view->length;
+        return view->data;
+    }
+    return luaL_checklstring(L, arg, length);
+}
+
+
 static int valid_array(lua_State *L) {
     int index;
     lua_pushnil(L);
@@ -82,22 +304,337 @@ static void json_error(json_t *json, const char *fmt, ...) {
     luaL_pushfail(json->L);
     lua_pushvfstring(json->L, fmt, va);
     va_end(va);
+    STATS_ADD(errors, 1);
     longjmp(json->jmp, 1);
 }
 
 
-static void json_flush(json_t *json) {
-    if (json->position > 0) {
-        lua_pushlstring(json->L, json->output, json->position);
+/*
+    Base64 conversion for the encoding option, the standalone base64 module
+    is not required. Decoding stops at the first padding character.
+*/
+static const char           base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static void base64_encode(const uint8_t *input, size_t length, char *output) {
+    uint32_t                value;
+
+    for (; length >= 3; input += 3, length -= 3, output += 4) {
+        value = ((uint32_t)input[0] << 16) | ((uint32_t)input[1] << 8) | input[2];
+        output[0] = base64_chars[value >> 18];
+        output[1] = base64_chars[(value >> 12) & 63];
+        output[2] = base64_chars[(value >> 6) & 63];
+        output[3] = base64_chars[value & 63];
+    }
+    if (length > 0) {
+        value = ((uint32_t)input[0] << 16) | ((length > 1) ? ((uint32_t)input[1] << 8) : 0);
+        output[0] = base64_chars[value >> 18];
+        output[1] = base64_chars[(value >> 12) & 63];
+        output[2] = (length > 1) ? base64_chars[(value >> 6) & 63] : '=';
+        output[3] = '=';
+    }
+}
+
+
+static int base64_value(uint8_t ch) {
+    if ((ch >= 'A') && (ch <= 'Z')) return ch - 'A';
+    if ((ch >= 'a') && (ch <= 'z')) return ch - 'a' + 26;
+    if ((ch >= '0') && (ch <= '9')) return ch - '0' + 52;
+    if (ch == '+') return 62;
+    if (ch == '/') return 63;
+    return -1;
+}
+
+
+/* returns the size of the output or (size_t)-1 with the position of the invalid character in *error */
+static size_t base64_decode(const uint8_t *input, size_t length, uint8_t *output, size_t *error) {
+    size_t                  i, size;
+    uint32_t                value;
+    int                     bits, v;
+
+    for (i = size = 0, value = 0, bits = 0; (i < length) && (input[i] != '='); ++i) {
+        if ((v = base64_value(input[i])) < 0) {
+            *error = i;
+            return (size_t)-1;
+        }
+        value = (value << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            output[size++] = (uint8_t)((value >> bits) & 255);
+        }
+    }
+    return size;
+}
+
+
+/* collector state saved by the gc option */
+typedef struct gc_t {
+    int                     running;
+} gc_t;
+
+
+/*
+    Stops the collector until the pushed to-be-closed value goes out of scope,
+    so partially built tables are not traversed again and again. Closing it
+    restarts the collector (also on errors). Restarting clears the debt of
+    the memory allocated in the meantime, so the collector continues at its
+    normal pace instead of traversing the new values inside the call.
+*/
+static void gc_pause(lua_State *L) {
+    gc_t                    *gc = (gc_t*)lua_newuserdatauv(L, sizeof(gc_t), 0);
+
+    gc->running = lua_gc(L, LUA_GCISRUNNING);
+    luaL_setmetatable(L, JSON_GC);
+    lua_toclose(L, -1);
+    lua_gc(L, LUA_GCSTOP);
+}
+
+
+static int f_gc_close(lua_State *L) {
+    gc_t                    *gc = (gc_t*)luaL_checkudata(L, 1, JSON_GC);
+
+    if (gc->running) {
+        gc->running = 0;
+        lua_gc(L, LUA_GCRESTART);
+    }
+    return 0;
+}
+
+
+/* registry key of the cached scratch buffer */
+static const char           scratch_key = 0;
+
+
+/*
+    Pushes a buffer of at least size bytes. Small buffers are reused unless
+    fresh is set: the cached buffer is taken out of the registry while it is
+    in use (so nested calls, e.g. from finalizers, get their own) and put back
+    by scratch_release(). A buffer lost by an error is simply allocated again.
+*/
+static char *scratch_buffer(lua_State *L, size_t size, int fresh) {
+    if (fresh || (size > JSON_SCRATCH_MAX))
+        return (char*)lua_newuserdatauv(L, size, 0);
+    if ((lua_rawgetp(L, LUA_REGISTRYINDEX, &scratch_key) == LUA_TUSERDATA) && (lua_rawlen(L, -1) >= size)) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &scratch_key);
+        return (char*)lua_touserdata(L, -1);
+    }
+    lua_pop(L, 1);
+    return (char*)lua_newuserdatauv(L, size, 0);
+}
+
+
+/* caches the buffer at index for the next call */
+static void scratch_release(lua_State *L, int index) {
+    if (lua_rawlen(L, index) <= JSON_SCRATCH_MAX) {
+        lua_pushvalue(L, index);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &scratch_key);
+    }
+}
+
+
+/*
+    Content hashes for the hash option, updated whenever the output buffer is
+    flushed while the bytes are still in the cache. Digests are returned as
+    lowercase hex strings.
+*/
+#define HASH_XXH64_P1       UINT64_C(11400714785074694791)
+#define HASH_XXH64_P2       UINT64_C(14029467366897019727)
+#define HASH_XXH64_P3       UINT64_C(1609587929392839161)
+#define HASH_XXH64_P4       UINT64_C(9650029242287828579)
+#define HASH_XXH64_P5       UINT64_C(2870177450012600261)
+
+
+/* CRC32C (Castagnoli) table, constant so that states in different threads share no mutable data */
+static const uint32_t       crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+
+static uint64_t xxh64_read(const uint8_t *data, int length) {
+    uint64_t                value = 0;
+
+    while (length-- > 0)
+        value = (value << 8) | data[length];
+    return value;
+}
+
+
+static uint64_t xxh64_rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return xxh64_rotl(acc + input * HASH_XXH64_P2, 31) * HASH_XXH64_P1;
+}
+
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+    return (acc ^ xxh64_round(0, value)) * HASH_XXH64_P1 + HASH_XXH64_P4;
+}
+
+
+static void hash_init(hash_t *hash, int type) {
+    hash->type = type;
+    hash->total = 0;
+    hash->size = 0;
+    hash->crc = 0xFFFFFFFF;
+    hash->acc[0] = HASH_XXH64_P1 + HASH_XXH64_P2;
+    hash->acc[1] = HASH_XXH64_P2;
+    hash->acc[2] = 0;
+    hash->acc[3] = -HASH_XXH64_P1;
+}
+
+
+static void hash_update(hash_t *hash, const uint8_t *data, size_t length) {
+    uint32_t                crc = hash->crc;
+    size_t                  n;
+    int                     i;
+
+    if (hash->type == HASH_CRC32C) {
+        for (; length > 0; --length)
+            crc = (crc >> 8) ^ crc32c_table[(crc ^ *data++) & 255];
+        hash->crc = crc;
+        return;
+    }
+    hash->total += length;
+    if (hash->size > 0) {
+        n = (length < 32 - hash->size) ? length : 32 - hash->size;
+        memcpy(hash->buffer + hash->size, data, n);
+        hash->size += n;
+        data += n;
+        length -= n;
+        if (hash->size < 32)
+            return;
+        for (i = 0; i < 4; ++i)
+            hash->acc[i] = xxh64_round(hash->acc[i], xxh64_read(hash->buffer + i * 8, 8));
+        hash->size = 0;
+    }
+    for (; length >= 32; data += 32, length -= 32) {
+        for (i = 0; i < 4; ++i)
+            hash->acc[i] = xxh64_round(hash->acc[i], xxh64_read(data + i * 8, 8));
+    }
+    memcpy(hash->buffer, data, length);
+    hash->size = length;
+}
+
+
+static void hash_push(lua_State *L, hash_t *hash) {
+    static const char       digits[] = "0123456789abcdef";
+    char                    hex[16];
+    uint64_t                value;
+    size_t                  i;
+    int                     length;
+
+    if (hash->type == HASH_CRC32C) {
+        value = hash->crc ^ 0xFFFFFFFF;
+        length = 8;
+    } else {
+        if (hash->total >= 32) {
+            value = xxh64_rotl(hash->acc[0], 1) + xxh64_rotl(hash->acc[1], 7) + xxh64_rotl(hash->acc[2], 12) + xxh64_rotl(hash->acc[3], 18);
+            for (i = 0; i < 4; ++i)
+                value = xxh64_merge(value, hash->acc[i]);
+        } else {
+            value = HASH_XXH64_P5;
+        }
+        value += hash->total;
+        for (i = 0; i + 8 <= hash->size; i += 8)
+            value = xxh64_rotl(value ^ xxh64_round(0, xxh64_read(hash->buffer + i, 8)), 27) * HASH_XXH64_P1 + HASH_XXH64_P4;
+        if (i + 4 <= hash->size) {
+            value = xxh64_rotl(value ^ (xxh64_read(hash->buffer + i, 4) * HASH_XXH64_P1), 23) * HASH_XXH64_P2 + HASH_XXH64_P3;
+            i += 4;
+        }
+        for (; i < hash->size; ++i)
+            value = xxh64_rotl(value ^ (hash->buffer[i] * HASH_XXH64_P5), 11) * HASH_XXH64_P1;
+        value ^= value >> 33;
+        value *= HASH_XXH64_P2;
+        value ^= value >> 29;
+        value *= HASH_XXH64_P3;
+        value ^= value >> 32;
+        length = 16;
+    }
+    for (i = length; i > 0; --i, value >>= 4)
+        hex[i - 1] = digits[value & 15];
+    lua_pushlstring(L, hex, length);
+}
+
+
+/* returns the hash type named by the option value on top of the stack */
+static int hash_option(lua_State *L, int arg) {
+    const char              *name;
+
+    if (lua_isnil(L, -1))
+        return HASH_NONE;
+    name = luaL_checkstring(L, -1);
+    if (strcmp(name, "xxh64") == 0)
+        return HASH_XXH64;
+    if (strcmp(name, "crc32c") == 0)
+        return HASH_CRC32C;
+    return luaL_argerror(L, arg, "hash must be 'xxh64' or 'crc32c'");
+}
+
+
+static void json_flush(json_t *json, int last) {
+    luaL_Buffer             buffer;
+    size_t                  length = json->position, size;
+
+    if (json->base64 && !last)
+        length -= length % 3; /* incomplete blocks are encoded by the next flush */
+    if (length > 0) {
+        if (json->hash.type != HASH_NONE)
+            hash_update(&json->hash, (const uint8_t*)json->output, length);
+        if (json->base64) {
+            size = (length + 2) / 3 * 4;
+            base64_encode((const uint8_t*)json->output, length, luaL_buffinitsize(json->L, &buffer, size));
+            luaL_pushresultsize(&buffer, size);
+        } else {
+            lua_pushlstring(json->L, json->output, length);
+        }
         lua_rawseti(json->L, json->table, json->index++);
-        json->position = 0;
+        STATS_ADD(bytes_out, length);
+        STATS_ADD(flushes, 1);
+        memmove(json->output, json->output + length, json->position - length);
+        json->position -= length;
     }
 }
 
 
 static void json_write(json_t *json, char ch) {
     if (json->position >= sizeof(json->output))
-        json_flush(json);
+        json_flush(json, 0);
     json->output[json->position++] = ch;
 }
 
@@ -118,8 +655,13 @@ static void json_write_strf(json_t *json, const char *fmt, ...) {
 }
 
 
+static char json_peek(json_t *json) {
+    return (json->input < json->end) ? *json->input : '\0';
+}
+
+
 static void parse_whitespace(json_t *json) {
-    while (*json->input && isspace(*json->input))
+    while ((json->input < json->end) && is_space(*json->input))
         ++json->input;
 }
 
@@ -128,7 +670,7 @@ static void parse_token(json_t *json, const char *token) {
     size_t i;
     parse_whitespace(json);
     for (i = 0; token[i]; ++i)
-        if (json->input[i] != token[i])
+        if ((json->input + i >= json->end) || (json->input[i] != token[i]))
             json_error(json, "expected token '%s'", token);
     json->input += i;
 }
@@ -141,11 +683,11 @@ static void decode_number(json_t *json) {
     lua_Number num;
 
     parse_whitespace(json);
-    for (i = 0; *json->input && i < sizeof(buffer); ++json->input, ++i) {
+    for (i = 0; (json->input < json->end) && i < sizeof(buffer); ++json->input, ++i) {
         switch (*json->input) {
             case '0': case '1': case '2': case '3': case '4':
             case '5': case '6': case '7': case '8': case '9':
-            case '.': case 'e': case 'E':
+            case '.': case 'e': case 'E': case '-': case '+':
                 buffer[i] = *json->input;
                 break;
             default:
@@ -170,13 +712,13 @@ static void decode_string(json_t *json) {
 
     parse_token(json, "\"");
     luaL_buffinit(json->L, &buffer);
-    for (; *json->input; json->input++) {
+    for (; json->input < json->end; json->input++) {
         code = *json->input;
         if (code == '"') {
             break;
         } else if (code == '\\') {
             json->input++;
-            switch (code = *json->input) {
+            switch (code = json_peek(json)) {
                 case '"': luaL_addchar(&buffer, '"'); break;
                 case '\\': luaL_addchar(&buffer, '\\'); break;
                 case '/': luaL_addchar(&buffer, '/'); break;
@@ -196,6 +738,62 @@ static void decode_string(json_t *json) {
 }
 
 
+static int number_char(char ch) {
+    return ((ch >= '0') && (ch <= '9')) || (ch == '.') || (ch == 'e') || (ch == 'E') || (ch == '-') || (ch == '+');
+}
+
+
+/*
+    Decodes an array which only contains numbers into a packed f64_t userdata.
+    Returns 0 without consuming any input if the array contains other values
+    (or is empty), so it can be decoded as a table instead.
+*/
+static int decode_numbers(json_t *json) {
+    const char              *scan;
+    char                    buffer[256];
+    size_t                  count, i, length;
+    f64_t                   *numbers;
+
+    if (!json->numeric)
+        return 0;
+
+    /* count the numbers and check that there is nothing else */
+    for (count = 0, scan = json->input + 1;; ++scan) {
+        while ((scan < json->end) && is_space(*scan))
+            ++scan;
+        if ((scan >= json->end) || !(((*scan >= '0') && (*scan <= '9')) || (*scan == '-')))
+            return 0;
+        while ((scan < json->end) && number_char(*scan))
+            ++scan;
+        ++count;
+        while ((scan < json->end) && is_space(*scan))
+            ++scan;
+        if ((scan < json->end) && (*scan == ']'))
+            break;
+        if ((scan >= json->end) || (*scan != ','))
+            return 0;
+    }
+
+    /* convert all numbers, Lua handles the decimal point of the current locale */
+    luaL_checkstack(json->L, 2, "not enough stack space");
+    numbers = (f64_t*)lua_newuserdatauv(json->L, sizeof(f64_t) + sizeof(double) * (count - 1), 0);
+    numbers->count = count;
+    luaL_setmetatable(json->L, JSON_F64);
+    for (i = 0, ++json->input; i < count; ++i, ++json->input) {
+        parse_whitespace(json);
+        for (length = 0; number_char(*json->input) && (length < sizeof(buffer) - 1); ++length)
+            buffer[length] = *json->input++;
+        buffer[length] = '\0';
+        if ((lua_stringtonumber(json->L, buffer) != length + 1) || number_char(*json->input))
+            json_error(json, "number expected");
+        numbers->values[i] = (double)lua_tonumber(json->L, -1);
+        lua_pop(json->L, 1);
+        parse_whitespace(json); /* skip to ',' or ']' */
+    }
+    return 1;
+}
+
+
 static void decode_array(json_t *json) {
     int i;
 
@@ -204,18 +802,18 @@ static void decode_array(json_t *json) {
 
     /* check empty array */
     parse_whitespace(json);
-    if (*json->input == ']') {
+    if (json_peek(json) == ']') {
         parse_token(json, "]");
         return;
     }
 
     /* parse values */
-    for (i = 1; *json->input; ++i) {
+    for (i = 1; json->input < json->end; ++i) {
         decode_value(json);
         lua_rawseti(json->L, -2, i);
 
         parse_whitespace(json);
-        if (*json->input == ']')
+        if (json_peek(json) == ']')
             break;
         parse_token(json, ",");
     }
@@ -229,20 +827,20 @@ static void decode_object(json_t *json) {
 
     /* check empty object */
     parse_whitespace(json);
-    if (*json->input == '}') {
+    if (json_peek(json) == '}') {
         parse_token(json, "}");
         return;
     }
 
     /* parse values */
-    while (*json->input) {
+    while (json->input < json->end) {
         decode_string(json);
         parse_token(json, ":");
         decode_value(json);
         lua_rawset(json->L, -3);
 
         parse_whitespace(json);
-        if (*json->input == '}')
+        if (json_peek(json) == '}')
             break;
         parse_token(json, ",");
     }
@@ -253,7 +851,7 @@ static void decode_object(json_t *json) {
 static void decode_value(json_t *json) {
     luaL_checkstack(json->L, 1, "not enough stack space");
     parse_whitespace(json);
-    switch (*json->input) {
+    switch (json_peek(json)) {
         case 'n': /* null */
             parse_token(json, "null");
             lua_pushnil(json->L);
@@ -274,13 +872,185 @@ static void decode_value(json_t *json) {
             decode_string(json);
             break;
         case '[': /* array */
+            if (decode_numbers(json))
+                break;
+            STATS_ENTER(json);
             decode_array(json);
+            STATS_LEAVE(json);
             break;
         case '{': /* object */
+            STATS_ENTER(json);
             decode_object(json);
+            STATS_LEAVE(json);
+            break;
+        default:
+            json_error(json, "invalid character '%c' found", json_peek(json));
+    }
+}
+
+
+/*
+    Table driven decoder for small documents. Whitespace skipping and the
+    dispatch on the next token are merged into one lookup per character and
+    plain strings are pushed without copying them into a buffer. It does not
+    create error messages: on any error the document is decoded again by the
+    regular decoder, which reports the error.
+*/
+static void small_error(json_t *json) {
+    longjmp(json->jmp, 1);
+}
+
+
+/* skips whitespace and returns the class of the next character */
+static int small_next(json_t *json) {
+    int                     type;
+    for (; json->input < json->end; ++json->input)
+        if ((type = char_class[(uint8_t)*json->input]) != CHAR_SPACE)
+            return type;
+    return CHAR_OTHER;
+}
+
+
+static void small_literal(json_t *json, const char *token, size_t length) {
+    if (((size_t)(json->end - json->input) < length) || (memcmp(json->input, token, length) != 0))
+        small_error(json);
+    json->input += length;
+}
+
+
+static void small_number(json_t *json) {
+    char                    buffer[64];
+    size_t                  i;
+    lua_Number              num;
+
+    for (i = 0; (json->input < json->end) && number_char(*json->input); ++json->input, ++i) {
+        if (i >= sizeof(buffer) - 1)
+            small_error(json);
+        buffer[i] = *json->input;
+    }
+    buffer[i] = '\0';
+    if (lua_stringtonumber(json->L, buffer) != i + 1)
+        small_error(json);
+    if (lua_isinteger(json->L, -1)) {
+        /* numbers are floats, like in the regular decoder */
+        num = lua_tonumber(json->L, -1);
+        lua_pop(json->L, 1);
+        lua_pushnumber(json->L, num);
+    }
+}
+
+
+static void small_string(json_t *json) {
+    const char              *start = ++json->input;
+    luaL_Buffer             buffer;
+    char                    code;
+
+    while ((json->input < json->end) && (*json->input != '"') && (*json->input != '\\'))
+        ++json->input;
+    if (json->input >= json->end)
+        small_error(json);
+    if (*json->input == '"') {
+        lua_pushlstring(json->L, start, (size_t)(json->input++ - start));
+        return;
+    }
+
+    /* unescape the rest of the string */
+    luaL_buffinit(json->L, &buffer);
+    luaL_addlstring(&buffer, start, (size_t)(json->input - start));
+    for (; json->input < json->end; ++json->input) {
+        code = *json->input;
+        if (code == '"') {
+            ++json->input;
+            luaL_pushresult(&buffer);
+            return;
+        } else if ((code == '\\') && (++json->input < json->end)) {
+            switch (*json->input) {
+                case '"': case '\\': case '/': code = *json->input; break;
+                case 'b': code = '\b'; break;
+                case 'f': code = '\f'; break;
+                case 'n': code = '\n'; break;
+                case 'r': code = '\r'; break;
+                case 't': code = '\t'; break;
+                default: small_error(json);
+            }
+        }
+        luaL_addchar(&buffer, code);
+    }
+    small_error(json); /* missing '"' */
+}
+
+
+static void small_value(json_t *json) {
+    int                     i, type;
+
+    luaL_checkstack(json->L, 2, "not enough stack space");
+    switch (small_next(json)) {
+        case CHAR_NULL:
+            small_literal(json, "null", 4);
+            lua_pushnil(json->L);
+            break;
+        case CHAR_FALSE:
+            small_literal(json, "false", 5);
+            lua_pushboolean(json->L, 0);
+            break;
+        case CHAR_TRUE:
+            small_literal(json, "true", 4);
+            lua_pushboolean(json->L, 1);
+            break;
+        case CHAR_NUMBER:
+            small_number(json);
+            break;
+        case CHAR_STRING:
+            small_string(json);
+            break;
+        case CHAR_ARRAY:
+            STATS_ENTER(json);
+            ++json->input;
+            lua_newtable(json->L);
+            if (small_next(json) == CHAR_ARRAY_END) {
+                ++json->input;
+            } else {
+                for (i = 1;; ++i) {
+                    small_value(json);
+                    lua_rawseti(json->L, -2, i);
+                    type = small_next(json);
+                    ++json->input;
+                    if (type == CHAR_ARRAY_END)
+                        break;
+                    if (type != CHAR_COMMA)
+                        small_error(json);
+                }
+            }
+            STATS_LEAVE(json);
+            break;
+        case CHAR_OBJECT:
+            STATS_ENTER(json);
+            ++json->input;
+            lua_newtable(json->L);
+            if (small_next(json) == CHAR_OBJECT_END) {
+                ++json->input;
+            } else {
+                for (;;) {
+                    if (small_next(json) != CHAR_STRING)
+                        small_error(json);
+                    small_string(json);
+                    if (small_next(json) != CHAR_COLON)
+                        small_error(json);
+                    ++json->input;
+                    small_value(json);
+                    lua_rawset(json->L, -3);
+                    type = small_next(json);
+                    ++json->input;
+                    if (type == CHAR_OBJECT_END)
+                        break;
+                    if (type != CHAR_COMMA)
+                        small_error(json);
+                }
+            }
+            STATS_LEAVE(json);
             break;
         default:
-            json_error(json, "invalid character '%c' found", *json->input);
+            small_error(json);
     }
 }
 
@@ -299,13 +1069,13 @@ static void encode_string(json_t *json) {
     json_write(json, '"');
     for (; *str; ++str) {
         switch (*str) {
-            case '\\':  json_write_str(json, "\\\\"); break;
-            case '"':   json_write_str(json, "\\\""); break;
-            case '\b':  json_write_str(json, "\\b"); break;
-            case '\f':  json_write_str(json, "\\f"); break;
-            case '\n':  json_write_str(json, "\\n"); break;
-            case '\r':  json_write_str(json, "\\r"); break;
-            case '\t':  json_write_str(json, "\\t"); break;
+            case '\\':  json_write_str(json, "\\\\"); STATS_ADD(escaped, 1); break;
+            case '"':   json_write_str(json, "\\\""); STATS_ADD(escaped, 1); break;
+            case '\b':  json_write_str(json, "\\b"); STATS_ADD(escaped, 1); break;
+            case '\f':  json_write_str(json, "\\f"); STATS_ADD(escaped, 1); break;
+            case '\n':  json_write_str(json, "\\n"); STATS_ADD(escaped, 1); break;
+            case '\r':  json_write_str(json, "\\r"); STATS_ADD(escaped, 1); break;
+            case '\t':  json_write_str(json, "\\t"); STATS_ADD(escaped, 1); break;
             default:    json_write(json, *str); break;
         }
     }
@@ -313,6 +1083,29 @@ static void encode_string(json_t *json) {
 }
 
 
+static void encode_numbers(json_t *json) {
+    f64_t                   *numbers = (f64_t*)lua_touserdata(json->L, -1);
+    char                    text[64];
+    size_t                  i;
+    int                     j, length;
+
+    json_write(json, '[');
+    for (i = 0; i < numbers->count; ++i) {
+        if (i > 0)
+            json_write(json, ',');
+        /* same format as Lua uses for floats */
+        length = snprintf(text, sizeof(text) - 2, LUA_NUMBER_FMT, (LUAI_UACNUMBER)numbers->values[i]);
+        if (text[strspn(text, "-0123456789")] == '\0') {
+            text[length++] = '.';
+            text[length++] = '0';
+        }
+        for (j = 0; j < length; ++j)
+            json_write(json, text[j]);
+    }
+    json_write(json, ']');
+}
+
+
 static void encode_table(json_t *json) {
     int more = 0;
     luaL_checkstack(json->L, 4, "not enough stack space");
@@ -370,8 +1163,16 @@ static void encode_value(json_t *json) {
             encode_string(json);
             break;
         case LUA_TTABLE:
+            STATS_ENTER(json);
             encode_table(json);
+            STATS_LEAVE(json);
             break;
+        case LUA_TUSERDATA:
+            if (luaL_testudata(json->L, -1, JSON_F64) != NULL) {
+                encode_numbers(json);
+                break;
+            }
+            /* fall through */
         default:
             json_error(json, "cannot encode Lua type '%s'", lua_typename(json->L, type));
     }
@@ -379,57 +1180,1111 @@ static void encode_value(json_t *json) {
 }
 
 
-static int f_encode(lua_State *L) {
-    json_t                  json;
+static void json_options(json_t *json, int arg) {
+    json->yield = 0;
+    json->numeric = 0;
+    json->base64 = 0;
+    json->hash.type = HASH_NONE;
+    json->gc = 0;
+    if (!lua_isnoneornil(json->L, arg)) {
+        luaL_checktype(json->L, arg, LUA_TTABLE);
+        lua_getfield(json->L, arg, "yield");
+        json->yield = (int)luaL_optinteger(json->L, -1, 0);
+        lua_getfield(json->L, arg, "numeric_arrays");
+        if (!lua_isnil(json->L, -1)) {
+            luaL_argcheck(json->L, strcmp(luaL_checkstring(json->L, -1), "f64") == 0, arg, "numeric_arrays must be 'f64'");
+            json->numeric = 1;
+        }
+        lua_getfield(json->L, arg, "encoding");
+        if (!lua_isnil(json->L, -1)) {
+            luaL_argcheck(json->L, strcmp(luaL_checkstring(json->L, -1), "base64") == 0, arg, "encoding must be 'base64'");
+            json->base64 = 1;
+        }
+        lua_getfield(json->L, arg, "hash");
+        hash_init(&json->hash, hash_option(json->L, arg));
+        lua_getfield(json->L, arg, "gc");
+        if (!lua_isnil(json->L, -1)) {
+            luaL_argcheck(json->L, strcmp(luaL_checkstring(json->L, -1), "pause") == 0, arg, "gc must be 'pause'");
+            json->gc = 1;
+        }
+        lua_pop(json->L, 5);
+    }
+}
+
+
+/* pushes the output plus the digest of the hash option, returns the number of results */
+static int json_pushresult(json_t *json) {
     luaL_Buffer             buffer;
     int                     i;
 
+    json_flush(json, 1);
+    luaL_buffinit(json->L, &buffer);
+    for (i = 1; i < json->index; ++i) {
+        lua_rawgeti(json->L, json->table, i);
+        luaL_addvalue(&buffer);
+    }
+    luaL_pushresult(&buffer);
+    if (json->hash.type == HASH_NONE)
+        return 1;
+    hash_push(json->L, &json->hash);
+    return 2;
+}
+
+
+/*
+    Resumable encoder / decoder. Containers are tracked in explicit frames
+    instead of recursion, so the work can be suspended with lua_yieldk after
+    every json->yield values. All Lua values stay on the coroutine stack.
+*/
+static resume_t *resume_new(lua_State *L, json_t *json) {
+    resume_t                *state = (resume_t*)lua_newuserdatauv(L, sizeof(resume_t), 0);
+    state->json = *json;
+    state->depth = state->done = 0;
+    state->value = 1;
+    state->top = lua_gettop(L);
+    return state;
+}
+
+
+static void resume_encode_value(resume_t *state) {
+    json_t                  *json = &state->json;
+    frame_t                 *frame;
+
+    if (lua_type(json->L, -1) != LUA_TTABLE) {
+        encode_value(json);
+        return;
+    }
+    if (state->depth >= JSON_MAX_DEPTH)
+        json_error(json, "too many nested values");
+    luaL_checkstack(json->L, 4, "not enough stack space");
+    STATS_ENTER(json);
+    frame = &state->frames[state->depth++];
+    frame->object = !valid_array(json->L);
+    frame->table = lua_gettop(json->L);
+    frame->more = 0;
+    json_write(json, frame->object ? '{' : '[');
+    lua_pushnil(json->L); /* first key */
+}
+
+
+static int k_encode(lua_State *L, int status, lua_KContext ctx) {
+    resume_t                *state = (resume_t*)lua_touserdata(L, (int)ctx);
+    json_t                  *json = &state->json;
+    frame_t                 *frame;
+    int                     budget = json->yield;
+
+    (void)status;
+    lua_settop(L, state->top); /* drop values passed to resume */
+    if (setjmp(json->jmp))
+        return 2;
+    for (;;) {
+        if ((state->depth == 0) && state->done)
+            break;
+        if (--budget < 0) {
+            state->top = lua_gettop(L);
+            return lua_yieldk(L, 0, ctx, k_encode);
+        }
+        if (state->depth == 0) {
+            state->done = 1;
+            lua_pushvalue(L, 1);
+            resume_encode_value(state);
+            continue;
+        }
+        frame = &state->frames[state->depth - 1];
+        if (lua_next(L, frame->table)) {
+            if (frame->more)
+                json_write(json, ',');
+            else
+                frame->more = 1;
+            if (frame->object) {
+                lua_pushvalue(L, -2);
+                if (lua_type(L, -1) != LUA_TSTRING)
+                    json_error(json, "cannot encode non-string keys for object");
+                encode_value(json);
+                json_write(json, ':');
+            }
+            resume_encode_value(state);
+        } else {
+            json_write(json, frame->object ? '}' : ']');
+            STATS_LEAVE(json);
+            state->depth--;
+            lua_pop(L, 1); /* pop table */
+        }
+    }
+    return json_pushresult(json);
+}
+
+
+/* stores the decoded value on top of the stack in its container */
+static void resume_attach(resume_t *state) {
+    frame_t                 *frame;
+
+    state->value = 0;
+    if (state->depth == 0) {
+        state->done = 1;
+        return;
+    }
+    frame = &state->frames[state->depth - 1];
+    if (frame->object)
+        lua_rawset(state->json.L, frame->table);
+    else
+        lua_rawseti(state->json.L, frame->table, ++frame->index);
+}
+
+
+static void resume_close(resume_t *state) {
+    STATS_LEAVE(&state->json);
+    state->depth--;
+    resume_attach(state);
+}
+
+
+static int k_decode(lua_State *L, int status, lua_KContext ctx) {
+    resume_t                *state = (resume_t*)lua_touserdata(L, (int)ctx);
+    json_t                  *json = &state->json;
+    frame_t                 *frame;
+    char                    code;
+    int                     budget = json->yield;
+
+    (void)status;
+    lua_settop(L, state->top); /* drop values passed to resume */
+    if (setjmp(json->jmp))
+        return 2;
+    while (!state->done) {
+        if (--budget < 0) {
+            state->top = lua_gettop(L);
+            return lua_yieldk(L, 0, ctx, k_decode);
+        }
+        frame = (state->depth > 0) ? &state->frames[state->depth - 1] : NULL;
+
+        /* separator or end of the current container */
+        if (!state->value) {
+            parse_whitespace(json);
+            if (json_peek(json) == (frame->object ? '}' : ']')) {
+                ++json->input;
+                resume_close(state);
+            } else {
+                parse_token(json, ",");
+                state->value = 1;
+            }
+            continue;
+        }
+
+        /* next value, objects start with the key */
+        luaL_checkstack(L, 3, "not enough stack space");
+        if ((frame != NULL) && frame->object) {
+            decode_string(json);
+            parse_token(json, ":");
+        }
+        parse_whitespace(json);
+        code = json_peek(json);
+        if ((code == '[') && decode_numbers(json)) {
+            resume_attach(state); /* packed numbers */
+        } else if ((code == '[') || (code == '{')) {
+            if (state->depth >= JSON_MAX_DEPTH)
+                json_error(json, "too many nested values");
+            STATS_ENTER(json);
+            ++json->input;
+            lua_newtable(L);
+            frame = &state->frames[state->depth++];
+            frame->table = lua_gettop(L);
+            frame->object = code == '{';
+            frame->index = 0;
+            parse_whitespace(json);
+            if (json_peek(json) == (frame->object ? '}' : ']')) {
+                ++json->input;
+                resume_close(state); /* empty container */
+            }
+        } else {
+            decode_value(json); /* scalars or errors */
+            resume_attach(state);
+        }
+    }
+    return 1;
+}
+
+
+static int f_encode(lua_State *L) {
+    json_t                  json;
+    int                     n;
+    STATS_BEGIN();
+
     /* prepare state */
     luaL_checkany(L, 1);
     lua_newtable(L);
     json.L = L;
+    json.depth = 0;
     json.position = 0;
     json.table = lua_absindex(L, -1);
     json.index = 1;
+    json_options(&json, 2);
+
+    /* encode in time slices when running inside a coroutine */
+    if ((json.yield > 0) && lua_isyieldable(L)) {
+        resume_new(L, &json);
+        return k_encode(L, LUA_OK, lua_gettop(L));
+    }
 
     /* handle errors */
-    if (setjmp(json.jmp))
+    if (setjmp(json.jmp)) {
+        STATS_END(encode);
         return 2;
+    }
 
     /* encode value */
     lua_pushvalue(L, 1);
     encode_value(&json);
 
     /* write output */
-    json_flush(&json);
-    luaL_buffinit(L, &buffer);
-    for (i = 1; i < json.index; ++i) {
-        lua_rawgeti(L, json.table, i);
-        luaL_addvalue(&buffer);
-    }
-    luaL_pushresult(&buffer);
-    return 1;
+    n = json_pushresult(&json);
+    STATS_END(encode);
+    return n;
 }
 
 
-static int f_decode(lua_State *L) {
+/* decodes input with the options at index 2 */
+static int json_decode_input(lua_State *L, const char *input, size_t length) {
     json_t                  json;
+    int                     top, scratch = 0;
+    char                    *output;
+    size_t                  error;
+    STATS_BEGIN();
 
     /* prepare state */
     json.L = L;
-    json.input = luaL_checkstring(L, 1);
-    if (setjmp(json.jmp))
+    json.depth = 0;
+    json_options(&json, 2);
+    if (json.base64) {
+        /* suspended decoders must not share the scratch buffer */
+        output = scratch_buffer(L, length / 4 * 3 + 3, json.yield > 0);
+        scratch = lua_gettop(L);
+        if ((length = base64_decode((const uint8_t*)input, length, (uint8_t*)output, &error)) == (size_t)-1) {
+            scratch_release(L, scratch);
+            luaL_pushfail(L);
+            lua_pushfstring(L, "invalid base64 character at position %I", (lua_Integer)error + 1);
+            STATS_END(decode);
+            return 2;
+        }
+        input = output;
+    }
+    json.input = input;
+    json.end = json.input + length;
+
+    /* decode in time slices when running inside a coroutine */
+    if ((json.yield > 0) && lua_isyieldable(L)) {
+        resume_new(L, &json);
+        return k_decode(L, LUA_OK, lua_gettop(L));
+    }
+    if (json.gc)
+        gc_pause(L);
+
+    /* small documents use the table driven decoder, errors are reported by the regular one */
+    if ((length <= JSON_SMALL_INPUT) && !json.numeric) {
+        top = lua_gettop(L);
+        if (setjmp(json.jmp) == 0) {
+            small_value(&json);
+            if (scratch)
+                scratch_release(L, scratch);
+            STATS_ADD(bytes_in, json.input - input);
+            STATS_END(decode);
+            return 1;
+        }
+        lua_settop(L, top);
+        json.input = input;
+        json.depth = 0;
+    }
+
+    if (setjmp(json.jmp)) {
+        if (scratch)
+            scratch_release(L, scratch);
+        STATS_ADD(bytes_in, json.input - input);
+        STATS_END(decode);
         return 2;
+    }
 
     /* decode value */
     decode_value(&json);
+    if (scratch)
+        scratch_release(L, scratch);
+    STATS_ADD(bytes_in, json.input - input);
+    STATS_END(decode);
+    return 1;
+}
+
+
+static int f_decode(lua_State *L) {
+    const char              *input;
+    size_t                  length;
+
+    input = check_data(L, 1, &length);
+    return json_decode_input(L, input, length);
+}
+
+
+static void file_close(lua_State *L, file_t *file) {
+#ifdef JSON_MMAP
+    (void)L;
+    if (file->data != NULL)
+        munmap((void*)file->data, file->length);
+#else
+    void                    *ud;
+    lua_Alloc               allocf = lua_getallocf(L, &ud);
+    if (file->data != NULL)
+        allocf(ud, (void*)file->data, file->length, 0);
+#endif
+    file->data = NULL;
+    file->length = 0;
+}
+
+
+/* pushes a userdata owning the contents of the file, returns NULL and sets errno on failure */
+static file_t *file_open(lua_State *L, const char *path) {
+    file_t                  *file = (file_t*)lua_newuserdatauv(L, sizeof(file_t), 0);
+#ifdef JSON_MMAP
+    struct stat             st;
+    void                    *data;
+    int                     fd, error = 0;
+#else
+    void                    *ud;
+    lua_Alloc               allocf = lua_getallocf(L, &ud);
+    FILE                    *fp;
+    long                    size;
+    int                     error = 0;
+#endif
+
+    file->data = NULL;
+    file->length = 0;
+    luaL_setmetatable(L, JSON_FILE);
+
+#ifdef JSON_MMAP
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0) {
+        error = errno;
+    } else if (st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            error = errno;
+        } else {
+            file->data = (const char*)data;
+            file->length = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+#else
+    if ((fp = fopen(path, "rb")) == NULL)
+        return NULL;
+    if ((fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) < 0) || (fseek(fp, 0, SEEK_SET) != 0)) {
+        error = errno ? errno : EIO;
+    } else if (size > 0) {
+        if ((file->data = (const char*)allocf(ud, NULL, 0, (size_t)size)) == NULL) {
+            error = ENOMEM;
+        } else {
+            file->length = (size_t)size;
+            if (fread((void*)file->data, 1, file->length, fp) != file->length)
+                error = ferror(fp) ? EIO : EINVAL; /* file changed while reading */
+        }
+    }
+    fclose(fp);
+#endif
+
+    if (error != 0) {
+        file_close(L, file);
+        errno = error;
+        return NULL;
+    }
+    return file;
+}
+
+
+static int f_decode_file(lua_State *L) {
+    file_t                  *file;
+    const char              *path = luaL_checkstring(L, 1);
+    int                     results;
+    STATS_BEGIN();
+
+    lua_settop(L, 2); /* the file is pushed behind the optional arguments */
+    if ((file = file_open(L, path)) == NULL) {
+        STATS_END(decode_file);
+        return luaL_fileresult(L, 0, path);
+    }
+    results = json_decode_input(L, file->data, file->length);
+    file_close(L, file);
+    STATS_END(decode_file);
+    return results;
+}
+
+
+static int f_file_gc(lua_State *L) {
+    file_close(L, (file_t*)luaL_checkudata(L, 1, JSON_FILE));
+    return 0;
+}
+
+
+static int f_f64_index(lua_State *L) {
+    f64_t                   *numbers = (f64_t*)luaL_checkudata(L, 1, JSON_F64);
+    lua_Integer             index;
+    int                     isnum;
+
+    index = lua_tointegerx(L, 2, &isnum);
+    if (isnum && (index >= 1) && ((size_t)index <= numbers->count))
+        lua_pushnumber(L, (lua_Number)numbers->values[index - 1]);
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+
+static int f_f64_len(lua_State *L) {
+    f64_t                   *numbers = (f64_t*)luaL_checkudata(L, 1, JSON_F64);
+    lua_pushinteger(L, (lua_Integer)numbers->count);
+    return 1;
+}
+
+
+static const luaL_Reg       f64_funcs[] = {
+    { "__index",            f_f64_index     },
+    { "__len",              f_f64_len       },
+    { NULL,                 NULL            }
+};
+
+
+/*
+    Batch decoding: worker threads turn documents into tapes without using the
+    Lua API at all. The calling thread creates the Lua values afterwards.
+*/
+typedef struct lexer_t {
+    jmp_buf                 jmp;
+    tape_t                  *tape;
+    const char              *input, *end;
+} lexer_t;
+
+
+static void lexer_error(lexer_t *lex, const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(lex->tape->error, sizeof(lex->tape->error), fmt, va);
+    va_end(va);
+    lex->tape->failed = 1;
+    longjmp(lex->jmp, 1);
+}
+
+
+static size_t lexer_token(lexer_t *lex, int type, size_t length) {
+    tape_t                  *tape = lex->tape;
+    token_t                 *tokens;
+    size_t                  size;
+
+    if (tape->count >= tape->size) {
+        size = tape->size ? tape->size * 2 : 64;
+        if ((tokens = (token_t*)realloc(tape->tokens, size * sizeof(token_t))) == NULL)
+            lexer_error(lex, "not enough memory");
+        tape->tokens = tokens;
+        tape->size = size;
+    }
+    tape->tokens[tape->count].type = type;
+    tape->tokens[tape->count].length = length;
+    return tape->count++;
+}
+
+
+static char lexer_peek(lexer_t *lex) {
+    return (lex->input < lex->end) ? *lex->input : '\0';
+}
+
+
+static void lexer_whitespace(lexer_t *lex) {
+    while ((lex->input < lex->end) && is_space(*lex->input))
+        ++lex->input;
+}
+
+
+static void lexer_expect(lexer_t *lex, const char *token) {
+    size_t i;
+    lexer_whitespace(lex);
+    for (i = 0; token[i]; ++i)
+        if ((lex->input + i >= lex->end) || (lex->input[i] != token[i]))
+            lexer_error(lex, "expected token '%s'", token);
+    lex->input += i;
+}
+
+
+/* strtod() for JSON numbers, retries with the decimal point of the locale like Lua does */
+static double lexer_strtod(char *buffer, char **end) {
+    double                  value = strtod(buffer, end);
+    char                    *point;
+
+    if ((**end == '.') && ((point = strchr(buffer, '.')) != NULL)) {
+        *point = localeconv()->decimal_point[0];
+        value = strtod(buffer, end);
+    }
+    return value;
+}
+
+
+static void lexer_number(lexer_t *lex) {
+    char buffer[256], *end;
+    size_t i;
+    int integer = 1;
+    token_t *token;
+
+    for (i = 0; (lex->input < lex->end) && (i < sizeof(buffer) - 1); ++lex->input, ++i) {
+        switch (*lex->input) {
+            case '.': case 'e': case 'E':
+                integer = 0;
+                /* fall through */
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+            case '-': case '+':
+                buffer[i] = *lex->input;
+                break;
+            default:
+                goto parse_number;
+        }
+    }
+
+parse_number:
+    /* integers like Lua does, floats when they do not fit */
+    buffer[i] = '\0';
+    i = lexer_token(lex, TAPE_NUMBER, 0);
+    token = &lex->tape->tokens[i];
+    if (integer) {
+        errno = 0;
+        token->value.integer = (lua_Integer)strtoll(buffer, &end, 10);
+        if (errno == 0)
+            token->type = TAPE_INTEGER;
+    }
+    if (token->type == TAPE_NUMBER)
+        token->value.number = (lua_Number)lexer_strtod(buffer, &end);
+    if ((end == buffer) || (*end != '\0'))
+        lexer_error(lex, "number expected");
+}
+
+
+static void lexer_add_string(lexer_t *lex, char ch) {
+    tape_t                  *tape = lex->tape;
+    char                    *strings;
+    size_t                  size;
+
+    if (tape->strings_length >= tape->strings_size) {
+        size = tape->strings_size ? tape->strings_size * 2 : 256;
+        if ((strings = (char*)realloc(tape->strings, size)) == NULL)
+            lexer_error(lex, "not enough memory");
+        tape->strings = strings;
+        tape->strings_size = size;
+    }
+    tape->strings[tape->strings_length++] = ch;
+}
+
+
+static void lexer_string(lexer_t *lex) {
+    const char              *start;
+    size_t                  index, offset;
+    char                    code;
+
+    lexer_expect(lex, "\"");
+    for (start = lex->input; (lex->input < lex->end) && (*lex->input != '"'); ++lex->input)
+        if (*lex->input == '\\')
+            break;
+
+    if (lexer_peek(lex) != '\\') {
+        /* plain string, reference the input */
+        index = lexer_token(lex, TAPE_STRING, (size_t)(lex->input - start));
+        lex->tape->tokens[index].value.offset = (size_t)(start - lex->tape->input);
+    } else {
+        /* unescape into the strings buffer */
+        offset = lex->tape->strings_length;
+        for (; start < lex->input; ++start)
+            lexer_add_string(lex, *start);
+        for (; (lex->input < lex->end) && (*lex->input != '"'); ++lex->input) {
+            code = *lex->input;
+            if (code == '\\') {
+                ++lex->input;
+                switch (code = lexer_peek(lex)) {
+                    case '"': case '\\': case '/': break;
+                    case 'b': code = '\b'; break;
+                    case 'f': code = '\f'; break;
+                    case 'n': code = '\n'; break;
+                    case 'r': code = '\r'; break;
+                    case 't': code = '\t'; break;
+                    default: lexer_error(lex, "invalid string escape '%c'", code);
+                }
+            }
+            lexer_add_string(lex, code);
+        }
+        index = lexer_token(lex, TAPE_ESCAPED, lex->tape->strings_length - offset);
+        lex->tape->tokens[index].value.offset = offset;
+    }
+    lexer_expect(lex, "\"");
+}
+
+
+static void lexer_value(lexer_t *lex, int depth) {
+    size_t                  index, items;
+
+    if (depth > JSON_MAX_DEPTH)
+        lexer_error(lex, "too many nested values");
+    lexer_whitespace(lex);
+    switch (lexer_peek(lex)) {
+        case 'n':
+            lexer_expect(lex, "null");
+            lexer_token(lex, TAPE_NULL, 0);
+            break;
+        case 'f':
+            lexer_expect(lex, "false");
+            lexer_token(lex, TAPE_FALSE, 0);
+            break;
+        case 't':
+            lexer_expect(lex, "true");
+            lexer_token(lex, TAPE_TRUE, 0);
+            break;
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9': case '-':
+            lexer_number(lex);
+            break;
+        case '"':
+            lexer_string(lex);
+            break;
+        case '[':
+            lexer_expect(lex, "[");
+            index = lexer_token(lex, TAPE_ARRAY, 0);
+            lexer_whitespace(lex);
+            items = 0;
+            if (lexer_peek(lex) != ']') {
+                for (;;) {
+                    lexer_value(lex, depth + 1);
+                    ++items;
+                    lexer_whitespace(lex);
+                    if (lexer_peek(lex) != ',')
+                        break;
+                    ++lex->input;
+                }
+            }
+            lexer_expect(lex, "]");
+            lex->tape->tokens[index].length = items;
+            break;
+        case '{':
+            lexer_expect(lex, "{");
+            index = lexer_token(lex, TAPE_OBJECT, 0);
+            lexer_whitespace(lex);
+            items = 0;
+            if (lexer_peek(lex) != '}') {
+                for (;;) {
+                    lexer_string(lex);
+                    lexer_expect(lex, ":");
+                    lexer_value(lex, depth + 1);
+                    ++items;
+                    lexer_whitespace(lex);
+                    if (lexer_peek(lex) != ',')
+                        break;
+                    ++lex->input;
+                }
+            }
+            lexer_expect(lex, "}");
+            lex->tape->tokens[index].length = items;
+            break;
+        default:
+            lexer_error(lex, "invalid character '%c' found", lexer_peek(lex));
+    }
+}
+
+
+static void tape_parse(tape_t *tape) {
+    lexer_t                 lex;
+    lex.tape = tape;
+    lex.input = tape->input;
+    lex.end = tape->input + tape->length;
+    if (setjmp(lex.jmp) == 0)
+        lexer_value(&lex, 0);
+}
+
+
+static void tape_free(tape_t *tape) {
+    free(tape->tokens);
+    free(tape->strings);
+    tape->tokens = NULL;
+    tape->strings = NULL;
+    tape->count = tape->size = 0;
+    tape->strings_length = tape->strings_size = 0;
+}
+
+
+/* creates the Lua value of the token at index, returns the index of the next token */
+static size_t tape_push(lua_State *L, tape_t *tape, size_t index) {
+    token_t                 *token = &tape->tokens[index++];
+    size_t                  i;
+
+    luaL_checkstack(L, 2, "not enough stack space");
+    switch (token->type) {
+        case TAPE_NULL:
+            lua_pushnil(L);
+            break;
+        case TAPE_FALSE:
+            lua_pushboolean(L, 0);
+            break;
+        case TAPE_TRUE:
+            lua_pushboolean(L, 1);
+            break;
+        case TAPE_NUMBER:
+            lua_pushnumber(L, token->value.number);
+            break;
+        case TAPE_INTEGER:
+            lua_pushinteger(L, token->value.integer);
+            break;
+        case TAPE_STRING:
+            lua_pushlstring(L, tape->input + token->value.offset, token->length);
+            break;
+        case TAPE_ESCAPED:
+            lua_pushlstring(L, tape->strings + token->value.offset, token->length);
+            break;
+        case TAPE_ARRAY:
+            lua_createtable(L, (int)token->length, 0);
+            for (i = 1; i <= token->length; ++i) {
+                index = tape_push(L, tape, index);
+                lua_rawseti(L, -2, (lua_Integer)i);
+            }
+            break;
+        case TAPE_OBJECT:
+            lua_createtable(L, 0, (int)token->length);
+            for (i = 0; i < token->length; ++i) {
+                index = tape_push(L, tape, index); /* key */
+                index = tape_push(L, tape, index); /* value */
+                lua_rawset(L, -3);
+            }
+            break;
+    }
+    return index;
+}
+
+
+/*
+    Messagepack writer for json.to_msgpack(). It writes the same encodings as
+    msgpack.encode() (smallest integers, floats as 32-bit when exact, bin for
+    strings which are not valid UTF-8) so both modules stay interchangeable.
+*/
+static int valid_utf8(const uint8_t *str, size_t length) {
+    static const uint8_t    table[256] = {
+        /* 0x00 - 0x7f -> ASCII */
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        /* 0x80 - 0xbf -> continuation bytes */
+        8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+        8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+        8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+        8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+        /* 0xc0 - 0xdf -> 2 byte encodings */
+        9, 9, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        /* 0xe0 - 0xef -> 3 byte encodings */
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        /* 0xf0 - 0xff -> 4 byte encodings */
+        3, 3, 3, 3, 3, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9
+    };
+    while (length > 0) {
+        size_t code = table[*str++]; --length;
+        if ((code > 3) || (code > length))
+            return 0;
+        for (; code > 0; --code, --length, ++str)
+            if (table[*str] != 8)
+                return 0;
+    }
+    return 1;
+}
+
+
+static void msgpack_write(luaL_Buffer *buffer, int code, uint64_t value, size_t length) {
+    luaL_addchar(buffer, (char)code);
+    for (; length > 0; --length)
+        luaL_addchar(buffer, (char)((value >> ((length - 1) * 8)) & 255));
+}
+
+
+static void msgpack_header(luaL_Buffer *buffer, size_t length, int fix, size_t fix_max, int code8, int code16, int code32) {
+    if (length <= fix_max)
+        luaL_addchar(buffer, (char)(fix + length));
+    else if (code8 && (length <= 0xff))
+        msgpack_write(buffer, code8, length, sizeof(uint8_t));
+    else if (length <= 0xffff)
+        msgpack_write(buffer, code16, length, sizeof(uint16_t));
+    else
+        msgpack_write(buffer, code32, length, sizeof(uint32_t));
+}
+
+
+static void msgpack_integer(luaL_Buffer *buffer, lua_Integer i) {
+    if (i >= 0) {
+        if (i <= 0x7f)
+            luaL_addchar(buffer, (char)i);
+        else if (i <= 0xff)
+            msgpack_write(buffer, 0xcc, (uint64_t)i, sizeof(uint8_t));
+        else if (i <= 0xffff)
+            msgpack_write(buffer, 0xcd, (uint64_t)i, sizeof(uint16_t));
+        else if (i <= 0xffffffff)
+            msgpack_write(buffer, 0xce, (uint64_t)i, sizeof(uint32_t));
+        else
+            msgpack_write(buffer, 0xcf, (uint64_t)i, sizeof(uint64_t));
+    } else {
+        if (i >= -32)
+            luaL_addchar(buffer, (char)i);
+        else if (i >= -128)
+            msgpack_write(buffer, 0xd0, (uint8_t)i, sizeof(uint8_t));
+        else if (i >= -32768)
+            msgpack_write(buffer, 0xd1, (uint16_t)i, sizeof(uint16_t));
+        else if (i >= -2147483648)
+            msgpack_write(buffer, 0xd2, (uint32_t)i, sizeof(uint32_t));
+        else
+            msgpack_write(buffer, 0xd3, (uint64_t)i, sizeof(uint64_t));
+    }
+}
+
+
+static void msgpack_string(luaL_Buffer *buffer, const char *str, size_t length) {
+    if (valid_utf8((const uint8_t*)str, length))
+        msgpack_header(buffer, length, 0xa0, 0x1f, 0xd9, 0xda, 0xdb);
+    else if (length <= 0xff)
+        msgpack_write(buffer, 0xc4, length, sizeof(uint8_t));
+    else if (length <= 0xffff)
+        msgpack_write(buffer, 0xc5, length, sizeof(uint16_t));
+    else
+        msgpack_write(buffer, 0xc6, length, sizeof(uint32_t));
+    luaL_addlstring(buffer, str, length);
+}
+
+
+static void msgpack_number(luaL_Buffer *buffer, lua_Number number) {
+    double f64 = (double)number;
+    float f32 = (float)f64;
+    if (f64 == f32) {
+        luaL_addchar(buffer, (char)0xca);
+        luaL_addlstring(buffer, (const char*)&f32, sizeof(f32));
+    } else {
+        luaL_addchar(buffer, (char)0xcb);
+        luaL_addlstring(buffer, (const char*)&f64, sizeof(f64));
+    }
+}
+
+
+/* writes the token at index as messagepack, returns the index of the next token */
+static size_t tape_msgpack(luaL_Buffer *buffer, tape_t *tape, size_t index) {
+    token_t                 *token = &tape->tokens[index++];
+    size_t                  i;
+
+    switch (token->type) {
+        case TAPE_NULL:
+            luaL_addchar(buffer, (char)0xc0);
+            break;
+        case TAPE_FALSE:
+            luaL_addchar(buffer, (char)0xc2);
+            break;
+        case TAPE_TRUE:
+            luaL_addchar(buffer, (char)0xc3);
+            break;
+        case TAPE_NUMBER:
+            msgpack_number(buffer, token->value.number);
+            break;
+        case TAPE_INTEGER:
+            msgpack_integer(buffer, token->value.integer);
+            break;
+        case TAPE_STRING:
+            msgpack_string(buffer, tape->input + token->value.offset, token->length);
+            break;
+        case TAPE_ESCAPED:
+            msgpack_string(buffer, tape->strings + token->value.offset, token->length);
+            break;
+        case TAPE_ARRAY:
+            msgpack_header(buffer, token->length, 0x90, 0x0f, 0, 0xdc, 0xdd);
+            for (i = 0; i < token->length; ++i)
+                index = tape_msgpack(buffer, tape, index);
+            break;
+        case TAPE_OBJECT:
+            msgpack_header(buffer, token->length, 0x80, 0x0f, 0, 0xde, 0xdf);
+            for (i = 0; i < token->length * 2; ++i)
+                index = tape_msgpack(buffer, tape, index); /* key / value */
+            break;
+    }
+    return index;
+}
+
+
+typedef struct worker_t {
+    batch_t                 *batch;
+    size_t                  first, step;
+#ifdef JSON_THREADS
+    pthread_t               thread;
+    int                     running;
+#endif
+} worker_t;
+
+
+static void *tape_worker(void *arg) {
+    worker_t                *worker = (worker_t*)arg;
+    size_t                  i;
+    for (i = worker->first; i < worker->batch->count; i += worker->step)
+        tape_parse(&worker->batch->tapes[i]);
+    return NULL;
+}
+
+
+static int f_batch_gc(lua_State *L) {
+    batch_t                 *batch = (batch_t*)luaL_checkudata(L, 1, JSON_BATCH);
+    size_t                  i;
+    for (i = 0; i < batch->count; ++i)
+        tape_free(&batch->tapes[i]);
+    return 0;
+}
+
+
+static int f_decode_many(lua_State *L) {
+    batch_t                 *batch;
+    worker_t                workers[JSON_MAX_THREADS];
+    size_t                  count, i, threads;
+    view_t                  *view;
+    STATS_BEGIN();
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    count = (size_t)luaL_len(L, 1);
+    threads = (size_t)luaL_optinteger(L, 2, JSON_DEFAULT_THREADS);
+    luaL_argcheck(L, (threads >= 1) && (threads <= JSON_MAX_THREADS), 2, "invalid number of threads");
+    if (threads > count)
+        threads = count ? count : 1;
+
+    /* the batch owns all tapes, even when creating the Lua values fails */
+    batch = (batch_t*)lua_newuserdatauv(L, sizeof(batch_t) + sizeof(tape_t) * (count ? count - 1 : 0), 0);
+    memset(batch, 0, sizeof(batch_t));
+    luaL_setmetatable(L, JSON_BATCH);
+    for (i = 0; i < count; ++i) {
+        memset(&batch->tapes[i], 0, sizeof(tape_t));
+        lua_rawgeti(L, 1, (lua_Integer)i + 1);
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            batch->tapes[i].input = lua_tolstring(L, -1, &batch->tapes[i].length);
+        } else if ((view = (view_t*)luaL_testudata(L, -1, "msgpack.view")) != NULL) {
+            batch->tapes[i].input = view->data;
+            batch->tapes[i].length = view->length;
+        } else {
+            return luaL_error(L, "document %d is not a string", (int)i + 1);
+        }
+        lua_pop(L, 1); /* the list keeps the string alive */
+        batch->count = i + 1;
+    }
+
+    /* tokenize all documents, the calling thread is the first worker */
+    for (i = 0; i < threads; ++i) {
+        workers[i].batch = batch;
+        workers[i].first = i;
+        workers[i].step = threads;
+#ifdef JSON_THREADS
+        workers[i].running = (i > 0) && (pthread_create(&workers[i].thread, NULL, tape_worker, &workers[i]) == 0);
+        if ((i > 0) && !workers[i].running)
+            tape_worker(&workers[i]);
+#else
+        if (i > 0)
+            tape_worker(&workers[i]);
+#endif
+    }
+    tape_worker(&workers[0]);
+#ifdef JSON_THREADS
+    for (i = 1; i < threads; ++i)
+        if (workers[i].running)
+            pthread_join(workers[i].thread, NULL);
+#endif
+
+    /* create Lua values in order */
+    lua_createtable(L, (int)count, 0);
+    lua_pushnil(L); /* errors */
+    for (i = 0; i < count; ++i) {
+        if (batch->tapes[i].failed) {
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+            }
+            lua_pushstring(L, batch->tapes[i].error);
+            lua_rawseti(L, -2, (lua_Integer)i + 1);
+        } else {
+            tape_push(L, &batch->tapes[i], 0);
+            lua_rawseti(L, -3, (lua_Integer)i + 1);
+        }
+        STATS_ADD(bytes_in, batch->tapes[i].length);
+        tape_free(&batch->tapes[i]);
+    }
+    STATS_END(decode_many);
+    return 2;
+}
+
+
+static int f_to_msgpack(lua_State *L) {
+    batch_t                 *batch;
+    luaL_Buffer             buffer;
+    STATS_BEGIN();
+
+    /* the tokens are owned by a batch, so they are freed on memory errors */
+    batch = (batch_t*)lua_newuserdatauv(L, sizeof(batch_t), 0);
+    memset(batch, 0, sizeof(batch_t));
+    luaL_setmetatable(L, JSON_BATCH);
+    batch->tapes[0].input = check_data(L, 1, &batch->tapes[0].length);
+    batch->count = 1;
+    tape_parse(&batch->tapes[0]);
+    if (batch->tapes[0].failed) {
+        luaL_pushfail(L);
+        lua_pushstring(L, batch->tapes[0].error);
+        tape_free(&batch->tapes[0]);
+        STATS_END(to_msgpack);
+        return 2;
+    }
+
+    /* write the tokens as messagepack */
+    luaL_buffinit(L, &buffer);
+    tape_msgpack(&buffer, &batch->tapes[0], 0);
+    luaL_pushresult(&buffer);
+    STATS_ADD(bytes_in, batch->tapes[0].length);
+    tape_free(&batch->tapes[0]);
+    STATS_END(to_msgpack);
     return 1;
 }
 
 
+#ifdef JSON_STATS
+static int f_stats(lua_State *L) {
+    int                     reset = lua_toboolean(L, 1); /* read before the result is pushed */
+
+    lua_createtable(L, 0, 16);
+    lua_pushinteger(L, json_stats.encode_calls); lua_setfield(L, -2, "encode_calls");
+    lua_pushinteger(L, json_stats.encode_ns); lua_setfield(L, -2, "encode_ns");
+    lua_pushinteger(L, json_stats.decode_calls); lua_setfield(L, -2, "decode_calls");
+    lua_pushinteger(L, json_stats.decode_ns); lua_setfield(L, -2, "decode_ns");
+    lua_pushinteger(L, json_stats.decode_file_calls); lua_setfield(L, -2, "decode_file_calls");
+    lua_pushinteger(L, json_stats.decode_file_ns); lua_setfield(L, -2, "decode_file_ns");
+    lua_pushinteger(L, json_stats.decode_many_calls); lua_setfield(L, -2, "decode_many_calls");
+    lua_pushinteger(L, json_stats.decode_many_ns); lua_setfield(L, -2, "decode_many_ns");
+    lua_pushinteger(L, json_stats.to_msgpack_calls); lua_setfield(L, -2, "to_msgpack_calls");
+    lua_pushinteger(L, json_stats.to_msgpack_ns); lua_setfield(L, -2, "to_msgpack_ns");
+    lua_pushinteger(L, json_stats.bytes_in); lua_setfield(L, -2, "bytes_in");
+    lua_pushinteger(L, json_stats.bytes_out); lua_setfield(L, -2, "bytes_out");
+    lua_pushinteger(L, json_stats.flushes); lua_setfield(L, -2, "flushes");
+    lua_pushinteger(L, json_stats.escaped); lua_setfield(L, -2, "escaped");
+    lua_pushinteger(L, json_stats.max_depth); lua_setfield(L, -2, "max_depth");
+    lua_pushinteger(L, json_stats.errors); lua_setfield(L, -2, "errors");
+    if (reset)
+        memset(&json_stats, 0, sizeof(json_stats));
+    return 1;
+}
+#endif
+
+
 static const luaL_Reg       funcs[] = {
     { "encode",             f_encode        },
     { "decode",             f_decode        },
+    { "decode_file",        f_decode_file   },
+    { "decode_many",        f_decode_many   },
+    { "to_msgpack",         f_to_msgpack    },
+#ifdef JSON_STATS
+    { "stats",              f_stats         },
+#endif
     { "_VERSION",           NULL            },
     { "_AUTHOR",            NULL            },
     { NULL,                 NULL            }
@@ -437,6 +2292,25 @@ static const luaL_Reg       funcs[] = {
 
 
 LUALIB_API int luaopen_json(lua_State *L) {
+    luaL_newmetatable(L, JSON_BATCH);
+    lua_pushcfunction(L, f_batch_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, JSON_FILE);
+    lua_pushcfunction(L, f_file_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, JSON_F64);
+    luaL_setfuncs(L, f64_funcs, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, JSON_GC);
+    lua_pushcfunction(L, f_gc_close);
+    lua_setfield(L, -2, "__close");
+    lua_pop(L, 1);
+
     luaL_newlib(L, funcs);
     lua_pushstring(L, JSON_VERSION);
     lua_setfield(L, -2, "_VERSION");
@@ -31,9 +31,25 @@
 
 ================================================================================
 */
+#if defined(MSGPACK_STATS) || defined(MSGPACK_MMAP)
+#define _POSIX_C_SOURCE 199309L
+#endif
+#ifdef MSGPACK_STATS
+#include <time.h>
+#endif
+#ifdef MSGPACK_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <stdio.h>
+#endif
+#include <errno.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <setjmp.h>
 
 #include "lua.h"
@@ -41,24 +57,135 @@
 
 
 #define MSGPACK_AUTHOR      "Sebastian Steinhauer <s.steinhauer@yahoo.de>"
-#define MSGPACK_VERSION     "1.0.2"
+#define MSGPACK_VERSION     "1.14.0"
+#define MSGPACK_MAX_DEPTH   1000
+#define MSGPACK_SCRATCH_MAX (1024 * 1024)
+#define MSGPACK_UNPACKER    "msgpack.unpacker"
+#define MSGPACK_VIEW        "msgpack.view"
+#define MSGPACK_SCHEMA      "msgpack.schema"
+#define MSGPACK_FILE        "msgpack.file"
+#define MSGPACK_INDEX       "msgpack.index"
+#define MSGPACK_GC          "msgpack.gc"
+#define MSGPACK_PACKER      "msgpack.packer"
+#define MSGPACK_EXT_KEY     1       /* extension type defining the next key of the dictionary */
+#define MSGPACK_EXT_KEY_REF 2       /* extension type referencing a key of the dictionary */
+#define MSGPACK_KEY_MIN     3       /* shorter keys are smaller than their reference */
+#define MSGPACK_MAX_KEYS    65536
+
+
+/* state of the hash option */
+enum { HASH_NONE, HASH_XXH64, HASH_CRC32C };
+
+
+typedef struct hash_t {
+    int                     type;
+    uint32_t                crc;
+    uint64_t                total;
+    uint64_t                acc[4];
+    uint8_t                 buffer[32];
+    size_t                  size;
+} hash_t;
 
 
 typedef struct msg_t {
     lua_State               *L;
     jmp_buf                 jmp;
     size_t                  position;
+    int                     depth;
 
     /* variables for input */
     const uint8_t           *input;
     size_t                  length;
+    size_t                  views;
+    int                     source;
+    int                     yield;
+    int                     base64;
+    int                     gc;
+
+    /* key dictionary of msgpack.packer() / msgpack.unpacker() at stack index keys (0 when disabled) */
+    int                     keys, key_count, key_max;
 
     /* variables for output */
     uint8_t                 buffer[1024 * 16];
     int                     table, index;
+    hash_t                  hash;
+    luaL_Buffer             *sized;
+    size_t                  size, written;
 } msg_t;
 
 
+/* keep the first two fields in sync with sts_base64.c and sts_json.c */
+typedef struct view_t {
+    const char              *data;
+    size_t                  length;
+} view_t;
+
+
+/* containers of a resumable encode / decode */
+typedef struct frame_t {
+    int                     table, map, pending;
+    lua_Integer             index;
+    uint64_t                items;
+} frame_t;
+
+
+typedef struct resume_t {
+    msg_t                   msg;
+    int                     depth, next, last, items, count, top;
+    frame_t                 frames[MSGPACK_MAX_DEPTH];
+} resume_t;
+
+
+typedef struct cursor_t {
+    const uint8_t           *input;
+    size_t                  length, position;
+} cursor_t;
+
+
+typedef struct field_t {
+    const char              *key;
+    const uint8_t           *encoded;
+    size_t                  length;
+} field_t;
+
+
+typedef struct schema_t {
+    int                     count, array;
+    field_t                 fields[1];
+} schema_t;
+
+
+/* contents of a file, mapped with MSGPACK_MMAP otherwise read into memory */
+typedef struct file_t {
+    const uint8_t           *data;
+    size_t                  length;
+} file_t;
+
+
+/* positions of all values of a binary, created by msgpack.index() */
+typedef struct index_t {
+    size_t                  count;
+    size_t                  positions[1];
+} index_t;
+
+
+typedef struct unpacker_t {
+    uint8_t                 *data;
+    size_t                  size, start, length;
+    int                     keys, key_count;
+
+    /* incremental scan of the value currently in progress */
+    size_t                  scan;
+    uint64_t                pending;
+} unpacker_t;
+
+
+/* the uservalue holds the key dictionary (key string -> id) */
+typedef struct packer_t {
+    int                     key_count, key_max;
+} packer_t;
+
+
 static int valid_utf8(const uint8_t *str, size_t length) {
     static const uint8_t    table[256] = {
         /* 0x00 - 0x7f -> ASCII */
@@ -107,6 +234,157 @@ static int count_table(lua_State *L) {
 }
 
 
+#ifdef MSGPACK_STATS
+/* counters are per thread, so every thread can run its own Lua state without locks */
+typedef struct stats_t {
+    lua_Integer             encode_calls, encode_ns;
+    lua_Integer             decode_calls, decode_ns;
+    lua_Integer             decode_file_calls, decode_file_ns;
+    lua_Integer             decode_all_calls, decode_all_ns;
+    lua_Integer             values_calls, values_ns;
+    lua_Integer             skip_calls, skip_ns;
+    lua_Integer             index_calls, index_ns;
+    lua_Integer             size_calls, size_ns;
+    lua_Integer             to_json_calls, to_json_ns;
+    lua_Integer             unpacker_calls, unpacker_ns;
+    lua_Integer             bytes_in, bytes_out, flushes;
+    lua_Integer             str, bin, max_depth, errors;
+} stats_t;
+
+
+/* _Thread_local is C11, older compilers have their own keyword */
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+static _Thread_local stats_t msg_stats;
+#elif defined(__GNUC__)
+static __thread stats_t msg_stats;
+#elif defined(_MSC_VER)
+static __declspec(thread) stats_t msg_stats;
+#else
+#error "MSGPACK_STATS requires thread local storage"
+#endif
+
+
+static lua_Integer stats_clock(void) {
+    struct timespec         ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lua_Integer)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+#define STATS_ADD(f, n)     (msg_stats.f += (lua_Integer)(n))
+#define STATS_ENTER(msg)    ((++(msg)->depth > msg_stats.max_depth) ? (void)(msg_stats.max_depth = (msg)->depth) : (void)0)
+#define STATS_LEAVE(msg)    (--(msg)->depth)
+#define STATS_BEGIN()       lua_Integer stats_start = stats_clock()
+#define STATS_END(op)       (msg_stats.op##_calls++, msg_stats.op##_ns += stats_clock() - stats_start)
+#else
+#define STATS_ADD(f, n)     ((void)0)
+#define STATS_ENTER(msg)    ((void)0)
+#define STATS_LEAVE(msg)    ((void)0)
+#define STATS_BEGIN()       int stats_start = 0
+#define STATS_END(op)       ((void)stats_start)
+#endif
+
+
+static const char *check_data(lua_State *L, int arg, size_t *length) {
+    view_t                  *view = (view_t*)luaL_testudata(L, arg, MSGPACK_VIEW);
+    if (view != NULL) {
+        *length = view->length;
+        return view->data;
+    }
+    return luaL_checklstring(L, arg, length);
+}
+
+
+/*
+    Inspects the header of the value at input[0..length) without creating any
+    Lua values. Returns the size of the header, 0 when more bytes are required
+    or -1 for invalid codes. *payload receives the amount of raw bytes which
+    follow the header and *items the amount of nested values.
+*/
+static int msg_header(const uint8_t *input, size_t length, uint64_t *payload, uint64_t *items) {
+    uint8_t                 code;
+    int                     size, i;
+
+    if (length < 1)
+        return 0;
+    code = input[0];
+    *payload = *items = 0;
+    switch (code) {
+        case 0xc0: case 0xc2: case 0xc3:
+            return 1;
+        case 0xca: *payload = 4; return 1;
+        case 0xcb: *payload = 8; return 1;
+        case 0xcc: case 0xd0: *payload = 1; return 1;
+        case 0xcd: case 0xd1: *payload = 2; return 1;
+        case 0xce: case 0xd2: *payload = 4; return 1;
+        case 0xcf: case 0xd3: *payload = 8; return 1;
+        case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+            *payload = 1 + ((uint64_t)1 << (code - 0xd4)); /* type plus data */
+            return 1;
+        case 0xc4: case 0xc7: case 0xd9: size = 1; break;
+        case 0xc5: case 0xc8: case 0xda: case 0xdc: case 0xde: size = 2; break;
+        case 0xc6: case 0xc9: case 0xdb: case 0xdd: case 0xdf: size = 4; break;
+        default:
+            if ((code <= 0x7f) || (code >= 0xe0)) {
+                return 1;
+            } else if (code <= 0x8f) {
+                *items = (code - 0x80) * 2;
+                return 1;
+            } else if (code <= 0x9f) {
+                *items = code - 0x90;
+                return 1;
+            } else if (code <= 0xbf) {
+                *payload = code - 0xa0;
+                return 1;
+            }
+            return -1;
+    }
+
+    /* codes followed by a big-endian length */
+    if (length < (size_t)size + 1)
+        return 0;
+    for (i = 1; i <= size; ++i)
+        *payload = (*payload << 8) | input[i];
+    if (code == 0xdc || code == 0xdd) {
+        *items = *payload;
+        *payload = 0;
+    } else if (code == 0xde || code == 0xdf) {
+        *items = *payload * 2;
+        *payload = 0;
+    } else if (code >= 0xc7 && code <= 0xc9) {
+        *payload += 1; /* type of the extension */
+    }
+    return size + 1;
+}
+
+
+/*
+    Advances *position behind the next complete value of input[0..length).
+    Returns 1 on success, 0 when more bytes are required or -1 for invalid codes.
+    On failure *position is the offset of the header where the walk stopped.
+*/
+static int msg_skip(const uint8_t *input, size_t length, size_t *position) {
+    size_t                  scan = *position;
+    uint64_t                pending, payload, items;
+    int                     size;
+
+    for (pending = 1; pending > 0; pending += items - 1) {
+        size = msg_header(input + scan, length - scan, &payload, &items);
+        if (size <= 0) {
+            *position = scan;
+            return size;
+        }
+        if (payload > length - scan - size) {
+            *position = scan;
+            return 0;
+        }
+        scan += size + (size_t)payload;
+    }
+    *position = scan;
+    return 1;
+}
+
+
 /* prototypes */
 static void msg_encode(msg_t *msg);
 static void msg_decode(msg_t *msg);
@@ -118,22 +396,345 @@ static void msg_error(msg_t *msg, const char *fmt, ...) {
     lua_pushnil(msg->L);
     lua_pushvfstring(msg->L, fmt, va);
     va_end(va);
+    STATS_ADD(errors, 1);
     longjmp(msg->jmp, 1);
 }
 
 
-static void msg_flush(msg_t *msg) {
-    if (msg->position > 0) {
-        lua_pushlstring(msg->L, (const char*)msg->buffer, msg->position);
-        lua_rawseti(msg->L, msg->table, msg->index++);
-        msg->position = 0;
+/*
+    Base64 conversion for the encoding option, the standalone base64 module
+    is not required. Decoding stops at the first padding character.
+*/
+static const char           base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static void base64_encode(const uint8_t *input, size_t length, char *output) {
+    uint32_t                value;
+
+    for (; length >= 3; input += 3, length -= 3, output += 4) {
+        value = ((uint32_t)input[0] << 16) | ((uint32_t)input[1] << 8) | input[2];
+        output[0] = base64_chars[value >> 18];
+        output[1] = base64_chars[(value >> 12) & 63];
+        output[2] = base64_chars[(value >> 6) & 63];
+        output[3] = base64_chars[value & 63];
+    }
+    if (length > 0) {
+        value = ((uint32_t)input[0] << 16) | ((length > 1) ? ((uint32_t)input[1] << 8) : 0);
+        output[0] = base64_chars[value >> 18];
+        output[1] = base64_chars[(value >> 12) & 63];
+        output[2] = (length > 1) ? base64_chars[(value >> 6) & 63] : '=';
+        output[3] = '=';
+    }
+}
+
+
+static int base64_value(uint8_t ch) {
+    if ((ch >= 'A') && (ch <= 'Z')) return ch - 'A';
+    if ((ch >= 'a') && (ch <= 'z')) return ch - 'a' + 26;
+    if ((ch >= '0') && (ch <= '9')) return ch - '0' + 52;
+    if (ch == '+') return 62;
+    if (ch == '/') return 63;
+    return -1;
+}
+
+
+/* returns the size of the output or (size_t)-1 with the position of the invalid character in *error */
+static size_t base64_decode(const uint8_t *input, size_t length, uint8_t *output, size_t *error) {
+    size_t                  i, size;
+    uint32_t                value;
+    int                     bits, v;
+
+    for (i = size = 0, value = 0, bits = 0; (i < length) && (input[i] != '='); ++i) {
+        if ((v = base64_value(input[i])) < 0) {
+            *error = i;
+            return (size_t)-1;
+        }
+        value = (value << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            output[size++] = (uint8_t)((value >> bits) & 255);
+        }
+    }
+    return size;
+}
+
+
+/* collector state saved by the gc option */
+typedef struct gc_t {
+    int                     running;
+} gc_t;
+
+
+/*
+    Stops the collector until the pushed to-be-closed value goes out of scope,
+    so partially built tables are not traversed again and again. Closing it
+    restarts the collector (also on errors). Restarting clears the debt of
+    the memory allocated in the meantime, so the collector continues at its
+    normal pace instead of traversing the new values inside the call.
+*/
+static void gc_pause(lua_State *L) {
+    gc_t                    *gc = (gc_t*)lua_newuserdatauv(L, sizeof(gc_t), 0);
+
+    gc->running = lua_gc(L, LUA_GCISRUNNING);
+    luaL_setmetatable(L, MSGPACK_GC);
+    lua_toclose(L, -1);
+    lua_gc(L, LUA_GCSTOP);
+}
+
+
+static int f_gc_close(lua_State *L) {
+    gc_t                    *gc = (gc_t*)luaL_checkudata(L, 1, MSGPACK_GC);
+
+    if (gc->running) {
+        gc->running = 0;
+        lua_gc(L, LUA_GCRESTART);
+    }
+    return 0;
+}
+
+
+/* registry key of the cached scratch buffer */
+static const char           scratch_key = 0;
+
+
+/*
+    Pushes a buffer of at least size bytes. Small buffers are reused unless
+    fresh is set: the cached buffer is taken out of the registry while it is
+    in use (so nested calls, e.g. from finalizers, get their own) and put back
+    by scratch_release(). A buffer lost by an error is simply allocated again.
+*/
+static uint8_t *scratch_buffer(lua_State *L, size_t size, int fresh) {
+    if (fresh || (size > MSGPACK_SCRATCH_MAX))
+        return (uint8_t*)lua_newuserdatauv(L, size, 0);
+    if ((lua_rawgetp(L, LUA_REGISTRYINDEX, &scratch_key) == LUA_TUSERDATA) && (lua_rawlen(L, -1) >= size)) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &scratch_key);
+        return (uint8_t*)lua_touserdata(L, -1);
+    }
+    lua_pop(L, 1);
+    return (uint8_t*)lua_newuserdatauv(L, size, 0);
+}
+
+
+/* caches the buffer at index for the next call */
+static void scratch_release(lua_State *L, int index) {
+    if (lua_rawlen(L, index) <= MSGPACK_SCRATCH_MAX) {
+        lua_pushvalue(L, index);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &scratch_key);
+    }
+}
+
+
+/*
+    Content hashes for the hash option, updated whenever the output buffer is
+    flushed while the bytes are still in the cache. Digests are returned as
+    lowercase hex strings.
+*/
+#define HASH_XXH64_P1       UINT64_C(11400714785074694791)
+#define HASH_XXH64_P2       UINT64_C(14029467366897019727)
+#define HASH_XXH64_P3       UINT64_C(1609587929392839161)
+#define HASH_XXH64_P4       UINT64_C(9650029242287828579)
+#define HASH_XXH64_P5       UINT64_C(2870177450012600261)
+
+
+/* CRC32C (Castagnoli) table, constant so that states in different threads share no mutable data */
+static const uint32_t       crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+
+static uint64_t xxh64_read(const uint8_t *data, int length) {
+    uint64_t                value = 0;
+
+    while (length-- > 0)
+        value = (value << 8) | data[length];
+    return value;
+}
+
+
+static uint64_t xxh64_rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return xxh64_rotl(acc + input * HASH_XXH64_P2, 31) * HASH_XXH64_P1;
+}
+
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+    return (acc ^ xxh64_round(0, value)) * HASH_XXH64_P1 + HASH_XXH64_P4;
+}
+
+
+static void hash_init(hash_t *hash, int type) {
+    hash->type = type;
+    hash->total = 0;
+    hash->size = 0;
+    hash->crc = 0xFFFFFFFF;
+    hash->acc[0] = HASH_XXH64_P1 + HASH_XXH64_P2;
+    hash->acc[1] = HASH_XXH64_P2;
+    hash->acc[2] = 0;
+    hash->acc[3] = -HASH_XXH64_P1;
+}
+
+
+static void hash_update(hash_t *hash, const uint8_t *data, size_t length) {
+    uint32_t                crc = hash->crc;
+    size_t                  n;
+    int                     i;
+
+    if (hash->type == HASH_CRC32C) {
+        for (; length > 0; --length)
+            crc = (crc >> 8) ^ crc32c_table[(crc ^ *data++) & 255];
+        hash->crc = crc;
+        return;
+    }
+    hash->total += length;
+    if (hash->size > 0) {
+        n = (length < 32 - hash->size) ? length : 32 - hash->size;
+        memcpy(hash->buffer + hash->size, data, n);
+        hash->size += n;
+        data += n;
+        length -= n;
+        if (hash->size < 32)
+            return;
+        for (i = 0; i < 4; ++i)
+            hash->acc[i] = xxh64_round(hash->acc[i], xxh64_read(hash->buffer + i * 8, 8));
+        hash->size = 0;
+    }
+    for (; length >= 32; data += 32, length -= 32) {
+        for (i = 0; i < 4; ++i)
+            hash->acc[i] = xxh64_round(hash->acc[i], xxh64_read(data + i * 8, 8));
+    }
+    memcpy(hash->buffer, data, length);
+    hash->size = length;
+}
+
+
+static void hash_push(lua_State *L, hash_t *hash) {
+    static const char       digits[] = "0123456789abcdef";
+    char                    hex[16];
+    uint64_t                value;
+    size_t                  i;
+    int                     length;
+
+    if (hash->type == HASH_CRC32C) {
+        value = hash->crc ^ 0xFFFFFFFF;
+        length = 8;
+    } else {
+        if (hash->total >= 32) {
+            value = xxh64_rotl(hash->acc[0], 1) + xxh64_rotl(hash->acc[1], 7) + xxh64_rotl(hash->acc[2], 12) + xxh64_rotl(hash->acc[3], 18);
+            for (i = 0; i < 4; ++i)
+                value = xxh64_merge(value, hash->acc[i]);
+        } else {
+            value = HASH_XXH64_P5;
+        }
+        value += hash->total;
+        for (i = 0; i + 8 <= hash->size; i += 8)
+            value = xxh64_rotl(value ^ xxh64_round(0, xxh64_read(hash->buffer + i, 8)), 27) * HASH_XXH64_P1 + HASH_XXH64_P4;
+        if (i + 4 <= hash->size) {
+            value = xxh64_rotl(value ^ (xxh64_read(hash->buffer + i, 4) * HASH_XXH64_P1), 23) * HASH_XXH64_P2 + HASH_XXH64_P3;
+            i += 4;
+        }
+        for (; i < hash->size; ++i)
+            value = xxh64_rotl(value ^ (hash->buffer[i] * HASH_XXH64_P5), 11) * HASH_XXH64_P1;
+        value ^= value >> 33;
+        value *= HASH_XXH64_P2;
+        value ^= value >> 29;
+        value *= HASH_XXH64_P3;
+        value ^= value >> 32;
+        length = 16;
+    }
+    for (i = length; i > 0; --i, value >>= 4)
+        hex[i - 1] = digits[value & 15];
+    lua_pushlstring(L, hex, length);
+}
+
+
+/* returns the hash type named by the option value on top of the stack */
+static int hash_option(lua_State *L, int arg) {
+    const char              *name;
+
+    if (lua_isnil(L, -1))
+        return HASH_NONE;
+    name = luaL_checkstring(L, -1);
+    if (strcmp(name, "xxh64") == 0)
+        return HASH_XXH64;
+    if (strcmp(name, "crc32c") == 0)
+        return HASH_CRC32C;
+    return luaL_argerror(L, arg, "hash must be 'xxh64' or 'crc32c'");
+}
+
+
+static void msg_flush(msg_t *msg, int last) {
+    luaL_Buffer             buffer;
+    size_t                  length = msg->position, size;
+
+    if (msg->base64 && !last)
+        length -= length % 3; /* incomplete blocks are encoded by the next flush */
+    if (length > 0) {
+        if (msg->hash.type != HASH_NONE)
+            hash_update(&msg->hash, msg->buffer, length);
+        if (msg->sized != NULL) {
+            /* the size option writes into one exactly sized buffer instead of the table */
+            if (length > msg->size - msg->written)
+                msg_error(msg, "encoded size exceeds the given size of %I bytes", (lua_Integer)msg->size);
+            memcpy(luaL_buffaddr(msg->sized) + msg->written, msg->buffer, length);
+            msg->written += length;
+        } else {
+            if (msg->base64) {
+                size = (length + 2) / 3 * 4;
+                base64_encode(msg->buffer, length, luaL_buffinitsize(msg->L, &buffer, size));
+                luaL_pushresultsize(&buffer, size);
+            } else {
+                lua_pushlstring(msg->L, (const char*)msg->buffer, length);
+            }
+            lua_rawseti(msg->L, msg->table, msg->index++);
+        }
+        STATS_ADD(bytes_out, length);
+        STATS_ADD(flushes, 1);
+        memmove(msg->buffer, msg->buffer + length, msg->position - length);
+        msg->position -= length;
     }
 }
 
 
 static void msg_write(msg_t *msg, const uint8_t value) {
     if (msg->position >= sizeof(msg->buffer))
-        msg_flush(msg);
+        msg_flush(msg, 0);
     msg->buffer[msg->position++] = value;
 }
 
@@ -165,12 +766,23 @@ static void msg_read_bin(msg_t *msg, uint8_t *ptr, const size_t length) {
 
 
 static void msg_read_str(msg_t *msg, const size_t length) {
-    luaL_Buffer buffer;
-    size_t i;
-    char *data = luaL_buffinitsize(msg->L, &buffer, length);
-    for (i = 0; i < length; ++i)
-        data[i] = (char)msg_read(msg);
-    luaL_pushresultsize(&buffer, length);
+    const char              *data = (const char*)msg->input + msg->position;
+    view_t                  *view;
+
+    if (length > msg->length - msg->position)
+        msg_error(msg, "required more bytes to decode messagepack");
+    msg->position += length;
+    if ((msg->views > 0) && (length >= msg->views)) {
+        /* reference the source string instead of copying the bytes */
+        view = (view_t*)lua_newuserdatauv(msg->L, sizeof(view_t), 1);
+        view->data = data;
+        view->length = length;
+        lua_pushvalue(msg->L, msg->source);
+        lua_setiuservalue(msg->L, -2, 1);
+        luaL_setmetatable(msg->L, MSGPACK_VIEW);
+    } else {
+        lua_pushlstring(msg->L, data, length);
+    }
 }
 
 
@@ -235,9 +847,10 @@ static void msg_encode_number(msg_t *msg) {
 
 static void msg_encode_string(msg_t *msg) {
     size_t                  length;
-    const uint8_t           *str = (const uint8_t*)luaL_checklstring(msg->L, -1, &length);
+    const uint8_t           *str = (const uint8_t*)check_data(msg->L, -1, &length);
 
     if (valid_utf8(str, length)) {
+        STATS_ADD(str, 1);
         if (length <= 0x1f) {
             msg_write(msg, 0xa0 + length);
         } else if (length <= 0xff) {
@@ -251,6 +864,7 @@ static void msg_encode_string(msg_t *msg) {
             msg_write_int(msg, length, sizeof(uint32_t));
         }
     } else {
+        STATS_ADD(bin, 1);
         if (length <= 0xff) {
             msg_write(msg, 0xc4);
             msg_write_int(msg, length, sizeof(uint8_t));
@@ -266,39 +880,103 @@ static void msg_encode_string(msg_t *msg) {
 }
 
 
-static void msg_encode_table(msg_t *msg) {
-    int items = count_table(msg->L);
-    if (items >= 0) {
-        if (items <= 0x0f) {
-            msg_write(msg, 0x90 + items);
-        } else if (items <= 0xffff) {
-            msg_write(msg, 0xdc);
-            msg_write_int(msg, items, sizeof(uint16_t));
+static void msg_write_array(msg_t *msg, int items) {
+    if (items <= 0x0f) {
+        msg_write(msg, 0x90 + items);
+    } else if (items <= 0xffff) {
+        msg_write(msg, 0xdc);
+        msg_write_int(msg, items, sizeof(uint16_t));
+    } else {
+        msg_write(msg, 0xdd);
+        msg_write_int(msg, items, sizeof(uint32_t));
+    }
+}
+
+
+static void msg_write_map(msg_t *msg, int items) {
+    if (items <= 0x0f) {
+        msg_write(msg, 0x80 + items);
+    } else if (items <= 0xffff) {
+        msg_write(msg, 0xde);
+        msg_write_int(msg, items, sizeof(uint16_t));
+    } else {
+        msg_write(msg, 0xdf);
+        msg_write_int(msg, items, sizeof(uint32_t));
+    }
+}
+
+
+/*
+    Writes the map key on top of the stack with the dictionary of a packer.
+    New keys are defined once by an extension value with the key bytes, the
+    decoder assigns them the next id. Afterwards only the id is written.
+*/
+static void msg_encode_key(msg_t *msg) {
+    lua_State               *L = msg->L;
+    const char              *key;
+    size_t                  length;
+    lua_Integer             id;
+
+    if ((lua_type(L, -1) != LUA_TSTRING) || (lua_rawlen(L, -1) < MSGPACK_KEY_MIN) || (lua_rawlen(L, -1) > 0xff)) {
+        msg_encode(msg);
+        return;
+    }
+    lua_pushvalue(L, -1);
+    if (lua_rawget(L, msg->keys) == LUA_TNUMBER) {
+        id = lua_tointeger(L, -1);
+        if (id <= 0xff) {
+            msg_write(msg, 0xd4);
+            msg_write(msg, MSGPACK_EXT_KEY_REF);
+            msg_write_int(msg, (uint64_t)id, sizeof(uint8_t));
         } else {
-            msg_write(msg, 0xdd);
-            msg_write_int(msg, items, sizeof(uint32_t));
+            msg_write(msg, 0xd5);
+            msg_write(msg, MSGPACK_EXT_KEY_REF);
+            msg_write_int(msg, (uint64_t)id, sizeof(uint16_t));
         }
+        lua_pop(L, 2);
+        return;
+    }
+    lua_pop(L, 1);
+    if (msg->key_count >= msg->key_max) {
+        msg_encode(msg);
+        return;
+    }
+    lua_pushvalue(L, -1);
+    lua_pushinteger(L, msg->key_count++);
+    lua_rawset(L, msg->keys);
+    key = lua_tolstring(L, -1, &length);
+    msg_write(msg, 0xc7);
+    msg_write_int(msg, length, sizeof(uint8_t));
+    msg_write(msg, MSGPACK_EXT_KEY);
+    msg_write_str(msg, (const uint8_t*)key, length);
+    lua_pop(L, 1); /* pop encoded key */
+}
+
+
+static void msg_encode_table(msg_t *msg) {
+    int items;
+    /* key, value, key copy and a flushed chunk, msg_encode_key() needs two more for the dictionary */
+    luaL_checkstack(msg->L, (msg->keys != 0) ? 6 : 4, "not enough stack space");
+    items = count_table(msg->L);
+    STATS_ENTER(msg);
+    if (items >= 0) {
+        msg_write_array(msg, items);
         lua_pushnil(msg->L);
         while (lua_next(msg->L, -2))
             msg_encode(msg); /* encode value */
     } else {
-        items = -items;
-        if (items <= 0x0f) {
-            msg_write(msg, 0x80 + items);
-        } else if (items <= 0xffff) {
-            msg_write(msg, 0xde);
-            msg_write_int(msg, items, sizeof(uint16_t));
-        } else {
-            msg_write(msg, 0xdf);
-            msg_write_int(msg, items, sizeof(uint32_t));
-        }
+        msg_write_map(msg, -items);
         lua_pushnil(msg->L);
         while (lua_next(msg->L, -2)) {
             lua_pushvalue(msg->L, -2);
-            msg_encode(msg); /* encode key */
+            if (msg->keys != 0)
+                msg_encode_key(msg);
+            else
+                msg_encode(msg); /* encode key */
             msg_encode(msg); /* encode value */
         }
     }
+    STATS_LEAVE(msg);
 }
 
 
@@ -320,6 +998,12 @@ static void msg_encode(msg_t *msg) {
         case LUA_TTABLE:
             msg_encode_table(msg);
             break;
+        case LUA_TUSERDATA:
+            if (luaL_testudata(msg->L, -1, MSGPACK_VIEW) != NULL) {
+                msg_encode_string(msg);
+                break;
+            }
+            /* fall through */
         default:
             msg_error(msg, "cannot encode Lua value of type '%s'", lua_typename(msg->L, t));
     }
@@ -327,23 +1011,127 @@ static void msg_encode(msg_t *msg) {
 }
 
 
+/*
+    Size calculation for msgpack.sizeof(). Follows the rules of msg_encode()
+    but only adds the size of every value to msg->position.
+*/
+static size_t size_integer(lua_Integer i) {
+    if (i >= 0)
+        return (i <= 0x7f) ? 1 : (i <= 0xff) ? 2 : (i <= 0xffff) ? 3 : (i <= 0xffffffff) ? 5 : 9;
+    return (i >= -32) ? 1 : (i >= -128) ? 2 : (i >= -32768) ? 3 : (i >= -2147483648) ? 5 : 9;
+}
+
+
+static size_t size_string(msg_t *msg) {
+    size_t                  length;
+    const uint8_t           *str = (const uint8_t*)check_data(msg->L, -1, &length);
+
+    if (valid_utf8(str, length))
+        return length + ((length <= 0x1f) ? 1 : (length <= 0xff) ? 2 : (length <= 0xffff) ? 3 : 5);
+    return length + ((length <= 0xff) ? 2 : (length <= 0xffff) ? 3 : 5);
+}
+
+
+static size_t size_container(int items) {
+    return (items <= 0x0f) ? 1 : (items <= 0xffff) ? 3 : 5;
+}
+
+
+static void size_value(msg_t *msg) {
+    int                     t = lua_type(msg->L, -1), items;
+    double                  f64;
+
+    switch (t) {
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+            msg->position += 1;
+            break;
+        case LUA_TNUMBER:
+            if (lua_isinteger(msg->L, -1)) {
+                msg->position += size_integer(lua_tointeger(msg->L, -1));
+            } else {
+                f64 = (double)lua_tonumber(msg->L, -1);
+                msg->position += (f64 == (float)f64) ? 5 : 9;
+            }
+            break;
+        case LUA_TSTRING:
+            msg->position += size_string(msg);
+            break;
+        case LUA_TTABLE:
+            if (++msg->depth > MSGPACK_MAX_DEPTH)
+                msg_error(msg, "too many nested values");
+            luaL_checkstack(msg->L, 3, "not enough stack space"); /* key, value and key copy */
+            items = count_table(msg->L);
+            msg->position += size_container((items >= 0) ? items : -items);
+            lua_pushnil(msg->L);
+            while (lua_next(msg->L, -2)) {
+                if (items < 0) {
+                    lua_pushvalue(msg->L, -2);
+                    size_value(msg); /* key */
+                }
+                size_value(msg);
+            }
+            --msg->depth;
+            break;
+        case LUA_TUSERDATA:
+            if (luaL_testudata(msg->L, -1, MSGPACK_VIEW) != NULL) {
+                msg->position += size_string(msg);
+                break;
+            }
+            /* fall through */
+        default:
+            msg_error(msg, "cannot encode Lua value of type '%s'", lua_typename(msg->L, t));
+    }
+    lua_pop(msg->L, 1); /* pop value */
+}
+
+
 static void decode_array(msg_t *msg, int items) {
     int                     i;
+    STATS_ENTER(msg);
     lua_createtable(msg->L, items, 0);
     for (i = 1; i <= items; ++i) {
         msg_decode(msg);
         lua_rawseti(msg->L, -2, i);
     }
+    STATS_LEAVE(msg);
 }
 
 
 static void decode_map(msg_t *msg, int items) {
+    STATS_ENTER(msg);
     lua_createtable(msg->L, 0, items);
     for (; items > 0; --items) {
         msg_decode(msg);
         msg_decode(msg);
         lua_rawset(msg->L, -3);
     }
+    STATS_LEAVE(msg);
+}
+
+
+/* decodes an extension value, only the key dictionary of an unpacker is supported */
+static void decode_ext(msg_t *msg, size_t length) {
+    const int8_t            type = (int8_t)msg_read(msg);
+    lua_Integer             id;
+
+    if ((msg->keys == 0) || ((type != MSGPACK_EXT_KEY) && (type != MSGPACK_EXT_KEY_REF)))
+        msg_error(msg, "unsupported extension type: %d", (int)type);
+    if (type == MSGPACK_EXT_KEY) {
+        if (msg->key_count >= MSGPACK_MAX_KEYS)
+            msg_error(msg, "too many keys in the dictionary");
+        luaL_checkstack(msg->L, 2, "too many values to unpack on stack");
+        msg_read_str(msg, length);
+        lua_pushvalue(msg->L, -1);
+        lua_rawseti(msg->L, msg->keys, ++msg->key_count);
+    } else {
+        if ((length != 1) && (length != 2))
+            msg_error(msg, "invalid key reference");
+        id = (lua_Integer)msg_read_int(msg, length);
+        if (id >= msg->key_count)
+            msg_error(msg, "unknown key reference: %d", (int)id);
+        lua_rawgeti(msg->L, msg->keys, id + 1);
+    }
 }
 
 
@@ -417,6 +1205,18 @@ static void msg_decode(msg_t *msg) {
         case 0xdf:
             decode_map(msg, (uint32_t)msg_read_int(msg, sizeof(uint32_t)));
             break;
+        case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+            decode_ext(msg, (size_t)1 << (code - 0xd4));
+            break;
+        case 0xc7:
+            decode_ext(msg, msg_read_int(msg, sizeof(uint8_t)));
+            break;
+        case 0xc8:
+            decode_ext(msg, msg_read_int(msg, sizeof(uint16_t)));
+            break;
+        case 0xc9:
+            decode_ext(msg, msg_read_int(msg, sizeof(uint32_t)));
+            break;
         default:
             if (code <= 0x7f) {
                 lua_pushinteger(msg->L, code);
@@ -429,74 +1229,1391 @@ static void msg_decode(msg_t *msg) {
             } else if (code >= 0xe0) {
                 lua_pushinteger(msg->L, (int8_t)code);
             } else {
-                msg_error(msg, "invalid messagepack code: 0x%x", code);
+                msg_error(msg, "invalid messagepack code: %d", code);
             }
             break;
     }
 }
 
 
-static int f_encode(lua_State *L) {
-    int                     i, n;
-    luaL_Buffer             buffer;
-    msg_t                   msg;
+/*
+    JSON writer for msgpack.to_json(). It reads the messagepack directly and
+    formats numbers / strings like json.encode(). Maps are always written as
+    objects (even empty ones) and must have string keys.
+*/
+static void json_write_integer(msg_t *msg, luaL_Buffer *buffer, lua_Integer value) {
+    lua_pushfstring(msg->L, "%I", value);
+    luaL_addvalue(buffer);
+}
 
-    /* init msgpack state */
-    lua_newtable(L);
-    msg.L = L;
-    msg.position = 0;
-    msg.index = 1;
-    msg.table = lua_absindex(L, -1);
 
-    /* handle errors */
-    if (setjmp(msg.jmp))
-        return 2;
+static void json_write_number(msg_t *msg, luaL_Buffer *buffer, lua_Number value) {
+    lua_pushfstring(msg->L, "%f", value);
+    luaL_addvalue(buffer);
+}
 
-    /* encode all arguments (-1 because of the table) */
-    for (i = 1, n = lua_gettop(L); i < n; ++i) {
-        lua_pushvalue(L, i);
-        msg_encode(&msg);
-    }
 
-    /* write output */
-    msg_flush(&msg);
-    luaL_buffinit(L, &buffer);
-    for (i = 1; i <= msg.index; ++i) {
-        lua_rawgeti(L, msg.table, i);
-        luaL_addvalue(&buffer);
+static void json_write_string(msg_t *msg, luaL_Buffer *buffer, size_t length) {
+    const char              *str = (const char*)msg->input + msg->position;
+
+    if (length > msg->length - msg->position)
+        msg_error(msg, "required more bytes to decode messagepack");
+    msg->position += length;
+    luaL_addchar(buffer, '"');
+    for (; length > 0; --length, ++str) {
+        switch (*str) {
+            case '\\':  luaL_addstring(buffer, "\\\\"); break;
+            case '"':   luaL_addstring(buffer, "\\\""); break;
+            case '\b':  luaL_addstring(buffer, "\\b"); break;
+            case '\f':  luaL_addstring(buffer, "\\f"); break;
+            case '\n':  luaL_addstring(buffer, "\\n"); break;
+            case '\r':  luaL_addstring(buffer, "\\r"); break;
+            case '\t':  luaL_addstring(buffer, "\\t"); break;
+            default:    luaL_addchar(buffer, *str); break;
+        }
     }
-    luaL_pushresult(&buffer);
-    return 1;
+    luaL_addchar(buffer, '"');
 }
 
 
-static int f_decode(lua_State *L) {
-    msg_t                   msg;
-    int                     items, count;
+static void json_write_value(msg_t *msg, luaL_Buffer *buffer);
+
+
+static void json_write_array(msg_t *msg, luaL_Buffer *buffer, uint64_t items) {
+    uint64_t                i;
+
+    if (++msg->depth > MSGPACK_MAX_DEPTH)
+        msg_error(msg, "too many nested values");
+    luaL_addchar(buffer, '[');
+    for (i = 0; i < items; ++i) {
+        if (i > 0)
+            luaL_addchar(buffer, ',');
+        json_write_value(msg, buffer);
+    }
+    luaL_addchar(buffer, ']');
+    --msg->depth;
+}
+
+
+static void json_write_object(msg_t *msg, luaL_Buffer *buffer, uint64_t items) {
+    uint64_t                i;
+    uint8_t                 code;
+
+    if (++msg->depth > MSGPACK_MAX_DEPTH)
+        msg_error(msg, "too many nested values");
+    luaL_addchar(buffer, '{');
+    for (i = 0; i < items; ++i) {
+        if (i > 0)
+            luaL_addchar(buffer, ',');
+        code = (msg->position < msg->length) ? msg->input[msg->position] : 0xa0;
+        if (!((code >= 0xa0) && (code <= 0xbf)) && !((code >= 0xc4) && (code <= 0xc6)) && !((code >= 0xd9) && (code <= 0xdb)))
+            msg_error(msg, "cannot convert non-string keys to JSON");
+        json_write_value(msg, buffer); /* key */
+        luaL_addchar(buffer, ':');
+        json_write_value(msg, buffer);
+    }
+    luaL_addchar(buffer, '}');
+    --msg->depth;
+}
+
+
+static void json_write_value(msg_t *msg, luaL_Buffer *buffer) {
+    const uint8_t code = msg_read(msg);
+    switch (code) {
+        case 0xc0:
+            luaL_addstring(buffer, "null");
+            break;
+        case 0xc2:
+            luaL_addstring(buffer, "false");
+            break;
+        case 0xc3:
+            luaL_addstring(buffer, "true");
+            break;
+        case 0xc4: case 0xd9:
+            json_write_string(msg, buffer, msg_read_int(msg, sizeof(uint8_t)));
+            break;
+        case 0xc5: case 0xda:
+            json_write_string(msg, buffer, msg_read_int(msg, sizeof(uint16_t)));
+            break;
+        case 0xc6: case 0xdb:
+            json_write_string(msg, buffer, msg_read_int(msg, sizeof(uint32_t)));
+            break;
+        case 0xca: {
+            float f32;
+            msg_read_bin(msg, (uint8_t*)&f32, sizeof(f32));
+            json_write_number(msg, buffer, f32);
+            break;
+        }
+        case 0xcb: {
+            double f64;
+            msg_read_bin(msg, (uint8_t*)&f64, sizeof(f64));
+            json_write_number(msg, buffer, f64);
+            break;
+        }
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+            json_write_integer(msg, buffer, (lua_Integer)msg_read_int(msg, (size_t)1 << (code - 0xcc)));
+            break;
+        case 0xd0:
+            json_write_integer(msg, buffer, (int8_t)msg_read_int(msg, sizeof(int8_t)));
+            break;
+        case 0xd1:
+            json_write_integer(msg, buffer, (int16_t)msg_read_int(msg, sizeof(int16_t)));
+            break;
+        case 0xd2:
+            json_write_integer(msg, buffer, (int32_t)msg_read_int(msg, sizeof(int32_t)));
+            break;
+        case 0xd3:
+            json_write_integer(msg, buffer, (int64_t)msg_read_int(msg, sizeof(int64_t)));
+            break;
+        case 0xdc:
+            json_write_array(msg, buffer, msg_read_int(msg, sizeof(uint16_t)));
+            break;
+        case 0xdd:
+            json_write_array(msg, buffer, msg_read_int(msg, sizeof(uint32_t)));
+            break;
+        case 0xde:
+            json_write_object(msg, buffer, msg_read_int(msg, sizeof(uint16_t)));
+            break;
+        case 0xdf:
+            json_write_object(msg, buffer, msg_read_int(msg, sizeof(uint32_t)));
+            break;
+        default:
+            if (code <= 0x7f) {
+                json_write_integer(msg, buffer, code);
+            } else if (code <= 0x8f) {
+                json_write_object(msg, buffer, code - 0x80);
+            } else if (code <= 0x9f) {
+                json_write_array(msg, buffer, code - 0x90);
+            } else if (code <= 0xbf) {
+                json_write_string(msg, buffer, code - 0xa0);
+            } else if (code >= 0xe0) {
+                json_write_integer(msg, buffer, (int8_t)code);
+            } else {
+                msg_error(msg, "invalid messagepack code: %d", code);
+            }
+            break;
+    }
+}
+
+
+static void msg_options(msg_t *msg, int arg) {
+    msg->views = 0;
+    msg->keys = 0;
+    msg->yield = 0;
+    msg->base64 = 0;
+    msg->hash.type = HASH_NONE;
+    msg->size = (size_t)-1;
+    msg->gc = 0;
+    if (!lua_isnoneornil(msg->L, arg)) {
+        luaL_checktype(msg->L, arg, LUA_TTABLE);
+        lua_getfield(msg->L, arg, "views");
+        msg->views = (size_t)luaL_optinteger(msg->L, -1, 0);
+        lua_getfield(msg->L, arg, "yield");
+        msg->yield = (int)luaL_optinteger(msg->L, -1, 0);
+        lua_getfield(msg->L, arg, "encoding");
+        if (!lua_isnil(msg->L, -1)) {
+            luaL_argcheck(msg->L, strcmp(luaL_checkstring(msg->L, -1), "base64") == 0, arg, "encoding must be 'base64'");
+            msg->base64 = 1;
+        }
+        lua_getfield(msg->L, arg, "hash");
+        hash_init(&msg->hash, hash_option(msg->L, arg));
+        lua_getfield(msg->L, arg, "size");
+        if (!lua_isnil(msg->L, -1)) {
+            luaL_argcheck(msg->L, luaL_checkinteger(msg->L, -1) >= 0, arg, "size must not be negative");
+            msg->size = (size_t)lua_tointeger(msg->L, -1);
+        }
+        lua_getfield(msg->L, arg, "gc");
+        if (!lua_isnil(msg->L, -1)) {
+            luaL_argcheck(msg->L, strcmp(luaL_checkstring(msg->L, -1), "pause") == 0, arg, "gc must be 'pause'");
+            msg->gc = 1;
+        }
+        lua_pop(msg->L, 6);
+    }
+}
+
+
+static void msg_init_output(msg_t *msg, lua_State *L) {
+    lua_newtable(L);
+    msg->L = L;
+    msg->position = 0;
+    msg->index = 1;
+    msg->table = lua_absindex(L, -1);
+    msg->depth = 0;
+    msg->base64 = 0;
+    msg->hash.type = HASH_NONE;
+    msg->sized = NULL;
+    msg->keys = 0;
+}
+
+
+/* pushes the output plus the digest of the hash option, returns the number of results */
+static int msg_pushresult(msg_t *msg) {
+    luaL_Buffer             buffer;
+    int                     i;
+
+    msg_flush(msg, 1);
+    if (msg->sized != NULL) {
+        if (msg->written != msg->size)
+            msg_error(msg, "encoded size of %I bytes differs from the given size", (lua_Integer)msg->written);
+        luaL_pushresultsize(msg->sized, msg->size);
+    } else {
+        luaL_buffinit(msg->L, &buffer);
+        for (i = 1; i < msg->index; ++i) {
+            lua_rawgeti(msg->L, msg->table, i);
+            luaL_addvalue(&buffer);
+        }
+        luaL_pushresult(&buffer);
+    }
+    if (msg->hash.type == HASH_NONE)
+        return 1;
+    hash_push(msg->L, &msg->hash);
+    return 2;
+}
+
+
+static int f_encode(lua_State *L) {
+    int                     i, n;
+    msg_t                   msg;
+    STATS_BEGIN();
+
+    /* init msgpack state */
+    msg_init_output(&msg, L);
+
+    /* handle errors */
+    if (setjmp(msg.jmp)) {
+        STATS_END(encode);
+        return 2;
+    }
+
+    /* encode all arguments (-1 because of the table) */
+    for (i = 1, n = lua_gettop(L); i < n; ++i) {
+        lua_pushvalue(L, i);
+        msg_encode(&msg);
+    }
+
+    /* write output */
+    msg_pushresult(&msg);
+    STATS_END(encode);
+    return 1;
+}
+
+
+/*
+    Resumable encoder / decoder. Containers are tracked in explicit frames
+    instead of recursion, so the work can be suspended with lua_yieldk after
+    every msg->yield values. All Lua values stay on the coroutine stack.
+*/
+static resume_t *resume_new(lua_State *L, msg_t *msg) {
+    resume_t                *state = (resume_t*)lua_newuserdatauv(L, sizeof(resume_t), 0);
+    state->msg = *msg;
+    state->depth = state->next = state->last = state->items = state->count = 0;
+    state->top = lua_gettop(L);
+    return state;
+}
+
+
+static void resume_encode_value(resume_t *state) {
+    msg_t                   *msg = &state->msg;
+    frame_t                 *frame;
+    int                     items;
+
+    if (lua_type(msg->L, -1) != LUA_TTABLE) {
+        msg_encode(msg);
+        return;
+    }
+    if (state->depth >= MSGPACK_MAX_DEPTH)
+        msg_error(msg, "too many nested values");
+    luaL_checkstack(msg->L, 3, "not enough stack space");
+    STATS_ENTER(msg);
+    items = count_table(msg->L);
+    if (items >= 0)
+        msg_write_array(msg, items);
+    else
+        msg_write_map(msg, -items);
+    frame = &state->frames[state->depth++];
+    frame->table = lua_gettop(msg->L);
+    frame->map = items < 0;
+    frame->pending = 0;
+    lua_pushnil(msg->L); /* first key */
+}
+
+
+static int k_encode(lua_State *L, int status, lua_KContext ctx) {
+    resume_t                *state = (resume_t*)lua_touserdata(L, (int)ctx);
+    msg_t                   *msg = &state->msg;
+    frame_t                 *frame;
+    int                     budget = msg->yield;
+
+    (void)status;
+    lua_settop(L, state->top); /* drop values passed to resume */
+    if (setjmp(msg->jmp))
+        return 2;
+    for (;;) {
+        if ((state->depth == 0) && (state->next > state->last))
+            break;
+        if (--budget < 0) {
+            state->top = lua_gettop(L);
+            return lua_yieldk(L, 0, ctx, k_encode);
+        }
+        if (state->depth == 0) {
+            lua_pushvalue(L, state->next++);
+            resume_encode_value(state);
+            continue;
+        }
+        frame = &state->frames[state->depth - 1];
+        if (frame->pending) {
+            frame->pending = 0;
+            resume_encode_value(state); /* value of a map entry */
+        } else if (lua_next(L, frame->table)) {
+            if (frame->map) {
+                frame->pending = 1;
+                lua_pushvalue(L, -2);
+            }
+            resume_encode_value(state);
+        } else {
+            STATS_LEAVE(msg);
+            state->depth--;
+            lua_pop(L, 1); /* pop table */
+        }
+    }
+    return msg_pushresult(msg);
+}
+
+
+/* stores the decoded value on top of the stack in its container */
+static void resume_attach(resume_t *state) {
+    frame_t                 *frame;
+
+    if (state->depth == 0) {
+        state->items++;
+        return;
+    }
+    frame = &state->frames[state->depth - 1];
+    frame->items--;
+    if (!frame->map)
+        lua_rawseti(state->msg.L, frame->table, ++frame->index);
+    else if ((frame->items % 2) == 0)
+        lua_rawset(state->msg.L, frame->table);
+}
+
+
+static int k_decode(lua_State *L, int status, lua_KContext ctx) {
+    resume_t                *state = (resume_t*)lua_touserdata(L, (int)ctx);
+    msg_t                   *msg = &state->msg;
+    frame_t                 *frame;
+    uint64_t                payload, items;
+    uint8_t                 code;
+    int                     size, budget = msg->yield;
+
+    (void)status;
+    lua_settop(L, state->top); /* drop values passed to resume */
+    if (setjmp(msg->jmp))
+        return 2;
+    for (;;) {
+        /* close all complete containers */
+        while ((state->depth > 0) && (state->frames[state->depth - 1].items == 0)) {
+            STATS_LEAVE(msg);
+            state->depth--;
+            resume_attach(state);
+        }
+        if ((state->depth == 0) && ((state->items >= state->count) || (msg->position >= msg->length)))
+            break;
+        if (--budget < 0) {
+            state->top = lua_gettop(L);
+            return lua_yieldk(L, 0, ctx, k_decode);
+        }
+
+        size = msg_header(msg->input + msg->position, msg->length - msg->position, &payload, &items);
+        code = (size > 0) ? msg->input[msg->position] : 0;
+        if ((size > 0) && (((code >= 0x80) && (code <= 0x9f)) || (code >= 0xdc && code <= 0xdf))) {
+            if (state->depth >= MSGPACK_MAX_DEPTH)
+                msg_error(msg, "too many nested values");
+            luaL_checkstack(L, 3, "too many values to unpack on stack");
+            STATS_ENTER(msg);
+            msg->position += size;
+            frame = &state->frames[state->depth++];
+            frame->map = (code <= 0x8f) || (code >= 0xde);
+            frame->items = items;
+            frame->index = 0;
+            if (items > msg->length - msg->position)
+                items = msg->length - msg->position; /* only a size hint */
+            if (frame->map)
+                lua_createtable(L, 0, (int)(items / 2));
+            else
+                lua_createtable(L, (int)items, 0);
+            frame->table = lua_gettop(L);
+        } else {
+            msg_decode(msg); /* scalars or errors */
+            resume_attach(state);
+        }
+    }
+    lua_pushinteger(L, msg->position + 1);
+    return state->items + 1;
+}
+
+
+static int f_encode_with(lua_State *L) {
+    int                     i, n;
+    msg_t                   msg;
+    resume_t                *state;
+    luaL_Buffer             buffer;
+    STATS_BEGIN();
+
+    /* init msgpack state */
+    msg_init_output(&msg, L);
+    msg_options(&msg, 1);
+    n = lua_gettop(L);
+
+    /* the output is written into one buffer of the given size (pushed behind the table) */
+    if (msg.size != (size_t)-1) {
+        luaL_argcheck(L, !msg.base64 && (msg.yield == 0), 1, "size cannot be combined with encoding or yield");
+        luaL_buffinitsize(L, &buffer, msg.size);
+        msg.sized = &buffer;
+        msg.written = 0;
+    }
+
+    /* encode in time slices when running inside a coroutine */
+    if ((msg.yield > 0) && lua_isyieldable(L)) {
+        state = resume_new(L, &msg);
+        state->next = 2;
+        state->last = n - 1;
+        return k_encode(L, LUA_OK, lua_gettop(L));
+    }
+
+    /* handle errors */
+    if (setjmp(msg.jmp)) {
+        STATS_END(encode);
+        return 2;
+    }
+
+    /* encode all arguments behind the options (-1 because of the table) */
+    for (i = 2; i < n; ++i) {
+        lua_pushvalue(L, i);
+        msg_encode(&msg);
+    }
+
+    /* write output */
+    n = msg_pushresult(&msg);
+    STATS_END(encode);
+    return n;
+}
+
+
+static int f_sizeof(lua_State *L) {
+    int                     i, n;
+    msg_t                   msg;
+    STATS_BEGIN();
+
+    msg.L = L;
+    msg.position = 0;
+    msg.depth = 0;
+    if (setjmp(msg.jmp)) {
+        STATS_END(size);
+        return 2;
+    }
+    for (i = 1, n = lua_gettop(L); i <= n; ++i) {
+        lua_pushvalue(L, i);
+        size_value(&msg);
+    }
+    lua_pushinteger(L, (lua_Integer)msg.position);
+    STATS_END(size);
+    return 1;
+}
+
+
+/*
+    Prepares msg to decode input with the arguments [start, count, options] at
+    index 2..4 and returns count. Base64 input is decoded into a buffer which
+    is pushed as source of views. Returns -1 with nil plus an error message
+    on the stack for invalid base64 characters.
+*/
+static int msg_init_input(msg_t *msg, lua_State *L, const uint8_t *input, size_t length) {
+    uint8_t                 *output;
+    size_t                  error;
+
+    msg->L = L;
+    msg->depth = 0;
+    msg_options(msg, 4);
+    if (msg->base64) {
+        /* views and suspended decoders must not share the scratch buffer */
+        output = scratch_buffer(L, length / 4 * 3 + 3, (msg->views > 0) || (msg->yield > 0));
+        if ((length = base64_decode(input, length, output, &error)) == (size_t)-1) {
+            scratch_release(L, lua_gettop(L));
+            luaL_pushfail(L);
+            lua_pushfstring(L, "invalid base64 character at position %I", (lua_Integer)error + 1);
+            return -1;
+        }
+        input = output;
+    }
+    msg->input = input;
+    msg->length = length;
+    msg->position = (size_t)luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, (msg->position >= 1) && (msg->position <= msg->length), 2, "invalid starting position");
+    --msg->position;
+    return (int)luaL_optinteger(L, 3, 1024 * 64);
+}
+
+
+/* decodes up to count values, views reference the source value on top of the stack */
+static int msg_decode_input(msg_t *msg, int count) {
+    lua_State               *L = msg->L;
+    int                     items;
+    STATS_BEGIN();
+
+    msg->source = lua_absindex(L, -1);
+
+    /* decode in time slices when running inside a coroutine */
+    if ((msg->yield > 0) && lua_isyieldable(L)) {
+        resume_new(L, msg)->count = count;
+        return k_decode(L, LUA_OK, lua_gettop(L));
+    }
+    if (msg->gc)
+        gc_pause(L);
+    STATS_ADD(bytes_in, -(lua_Integer)msg->position);
+
+    /* handle errors */
+    if (setjmp(msg->jmp)) {
+        if (msg->base64 && (msg->views == 0))
+            scratch_release(L, msg->source);
+        STATS_ADD(bytes_in, msg->position);
+        STATS_END(decode);
+        return 2;
+    }
+
+    /* decode items, the scratch buffer is free again unless views reference it */
+    for (items = 0; (items < count) && (msg->position < msg->length); ++items)
+        msg_decode(msg);
+    if (msg->base64 && (msg->views == 0))
+        scratch_release(L, msg->source);
+    lua_pushinteger(L, msg->position + 1);
+    STATS_ADD(bytes_in, msg->position);
+    STATS_END(decode);
+    return items + 1;
+}
+
+
+static int f_decode(lua_State *L) {
+    msg_t                   msg;
+    const uint8_t           *input;
+    size_t                  length;
+    int                     count;
 
     /* prepare state */
+    input = (const uint8_t*)check_data(L, 1, &length);
+    if ((count = msg_init_input(&msg, L, input, length)) < 0)
+        return 2;
+
+    /* views always reference the original string (or the decoded base64) */
+    if (!msg.base64) {
+        if (lua_type(L, 1) == LUA_TUSERDATA)
+            lua_getiuservalue(L, 1, 1);
+        else
+            lua_pushvalue(L, 1);
+    }
+    return msg_decode_input(&msg, count);
+}
+
+
+static void file_close(lua_State *L, file_t *file) {
+#ifdef MSGPACK_MMAP
+    (void)L;
+    if (file->data != NULL)
+        munmap((void*)file->data, file->length);
+#else
+    void                    *ud;
+    lua_Alloc               allocf = lua_getallocf(L, &ud);
+    if (file->data != NULL)
+        allocf(ud, (void*)file->data, file->length, 0);
+#endif
+    file->data = NULL;
+    file->length = 0;
+}
+
+
+/* pushes a userdata owning the contents of the file, returns NULL and sets errno on failure */
+static file_t *file_open(lua_State *L, const char *path) {
+    file_t                  *file = (file_t*)lua_newuserdatauv(L, sizeof(file_t), 0);
+#ifdef MSGPACK_MMAP
+    struct stat             st;
+    void                    *data;
+    int                     fd, error = 0;
+#else
+    void                    *ud;
+    lua_Alloc               allocf = lua_getallocf(L, &ud);
+    FILE                    *fp;
+    long                    size;
+    int                     error = 0;
+#endif
+
+    file->data = NULL;
+    file->length = 0;
+    luaL_setmetatable(L, MSGPACK_FILE);
+
+#ifdef MSGPACK_MMAP
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0) {
+        error = errno;
+    } else if (st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            error = errno;
+        } else {
+            file->data = (const uint8_t*)data;
+            file->length = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+#else
+    if ((fp = fopen(path, "rb")) == NULL)
+        return NULL;
+    if ((fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) < 0) || (fseek(fp, 0, SEEK_SET) != 0)) {
+        error = errno ? errno : EIO;
+    } else if (size > 0) {
+        if ((file->data = (const uint8_t*)allocf(ud, NULL, 0, (size_t)size)) == NULL) {
+            error = ENOMEM;
+        } else {
+            file->length = (size_t)size;
+            if (fread((void*)file->data, 1, file->length, fp) != file->length)
+                error = ferror(fp) ? EIO : EINVAL; /* file changed while reading */
+        }
+    }
+    fclose(fp);
+#endif
+
+    if (error != 0) {
+        file_close(L, file);
+        errno = error;
+        return NULL;
+    }
+    return file;
+}
+
+
+static int f_decode_file(lua_State *L) {
+    msg_t                   msg;
+    file_t                  *file;
+    const char              *path = luaL_checkstring(L, 1);
+    int                     count, results;
+    STATS_BEGIN();
+
+    lua_settop(L, 4); /* the file is pushed behind the optional arguments */
+    if ((file = file_open(L, path)) == NULL) {
+        STATS_END(decode_file);
+        return luaL_fileresult(L, 0, path);
+    }
+    if ((count = msg_init_input(&msg, L, file->data, file->length)) < 0) {
+        STATS_END(decode_file);
+        return 2;
+    }
+
+    /* views keep the file alive, otherwise it is released right away */
+    results = msg_decode_input(&msg, count);
+    if (msg.views == 0)
+        file_close(L, file);
+    STATS_END(decode_file);
+    return results;
+}
+
+
+static int f_file_gc(lua_State *L) {
+    file_close(L, (file_t*)luaL_checkudata(L, 1, MSGPACK_FILE));
+    return 0;
+}
+
+
+#ifdef MSGPACK_STATS
+static int f_stats(lua_State *L) {
+    int                     reset = lua_toboolean(L, 1); /* read before the result is pushed */
+
+    lua_createtable(L, 0, 27);
+    lua_pushinteger(L, msg_stats.encode_calls); lua_setfield(L, -2, "encode_calls");
+    lua_pushinteger(L, msg_stats.encode_ns); lua_setfield(L, -2, "encode_ns");
+    lua_pushinteger(L, msg_stats.decode_calls); lua_setfield(L, -2, "decode_calls");
+    lua_pushinteger(L, msg_stats.decode_ns); lua_setfield(L, -2, "decode_ns");
+    lua_pushinteger(L, msg_stats.decode_file_calls); lua_setfield(L, -2, "decode_file_calls");
+    lua_pushinteger(L, msg_stats.decode_file_ns); lua_setfield(L, -2, "decode_file_ns");
+    lua_pushinteger(L, msg_stats.decode_all_calls); lua_setfield(L, -2, "decode_all_calls");
+    lua_pushinteger(L, msg_stats.decode_all_ns); lua_setfield(L, -2, "decode_all_ns");
+    lua_pushinteger(L, msg_stats.values_calls); lua_setfield(L, -2, "values_calls");
+    lua_pushinteger(L, msg_stats.values_ns); lua_setfield(L, -2, "values_ns");
+    lua_pushinteger(L, msg_stats.skip_calls); lua_setfield(L, -2, "skip_calls");
+    lua_pushinteger(L, msg_stats.skip_ns); lua_setfield(L, -2, "skip_ns");
+    lua_pushinteger(L, msg_stats.index_calls); lua_setfield(L, -2, "index_calls");
+    lua_pushinteger(L, msg_stats.index_ns); lua_setfield(L, -2, "index_ns");
+    lua_pushinteger(L, msg_stats.size_calls); lua_setfield(L, -2, "sizeof_calls");
+    lua_pushinteger(L, msg_stats.size_ns); lua_setfield(L, -2, "sizeof_ns");
+    lua_pushinteger(L, msg_stats.to_json_calls); lua_setfield(L, -2, "to_json_calls");
+    lua_pushinteger(L, msg_stats.to_json_ns); lua_setfield(L, -2, "to_json_ns");
+    lua_pushinteger(L, msg_stats.unpacker_calls); lua_setfield(L, -2, "unpacker_calls");
+    lua_pushinteger(L, msg_stats.unpacker_ns); lua_setfield(L, -2, "unpacker_ns");
+    lua_pushinteger(L, msg_stats.bytes_in); lua_setfield(L, -2, "bytes_in");
+    lua_pushinteger(L, msg_stats.bytes_out); lua_setfield(L, -2, "bytes_out");
+    lua_pushinteger(L, msg_stats.flushes); lua_setfield(L, -2, "flushes");
+    lua_pushinteger(L, msg_stats.str); lua_setfield(L, -2, "str");
+    lua_pushinteger(L, msg_stats.bin); lua_setfield(L, -2, "bin");
+    lua_pushinteger(L, msg_stats.max_depth); lua_setfield(L, -2, "max_depth");
+    lua_pushinteger(L, msg_stats.errors); lua_setfield(L, -2, "errors");
+    if (reset)
+        memset(&msg_stats, 0, sizeof(msg_stats));
+    return 1;
+}
+#endif
+
+
+static int f_values_next(lua_State *L) {
+    cursor_t                *values = (cursor_t*)lua_touserdata(L, lua_upvalueindex(1));
+    msg_t                   msg;
+    STATS_BEGIN();
+
+    if (values->position >= values->length) {
+        STATS_END(values);
+        return 0;
+    }
+    msg.L = L;
+    msg.input = values->input;
+    msg.length = values->length;
+    msg.position = values->position;
+    msg.views = 0;
+    msg.keys = 0;
+    msg.depth = 0;
+    if (setjmp(msg.jmp)) {
+        STATS_END(values);
+        return lua_error(L); /* a generic for cannot handle nil plus message */
+    }
+    lua_pushinteger(L, (lua_Integer)values->position + 1);
+    msg_decode(&msg);
+    values->position = msg.position;
+    STATS_END(values);
+    return 2;
+}
+
+
+static int f_values(lua_State *L) {
+    size_t                  length, position;
+    const uint8_t           *input = (const uint8_t*)check_data(L, 1, &length);
+    cursor_t                *values;
+
+    position = (size_t)luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, (position >= 1) && (position <= length + 1), 2, "invalid starting position");
+
+    /* the cursor lives in a userdata which also keeps the binary alive */
+    values = (cursor_t*)lua_newuserdatauv(L, sizeof(cursor_t), 1);
+    values->input = input;
+    values->length = length;
+    values->position = position - 1;
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+    lua_pushcclosure(L, f_values_next, 1);
+    return 1;
+}
+
+
+/* pushes nil plus the error message for a failed msg_skip(), position is where the walk stopped */
+static int skip_error(lua_State *L, const uint8_t *input, size_t position, int status) {
+    lua_pushnil(L);
+    if (status < 0)
+        lua_pushfstring(L, "invalid messagepack code: %d at position %I", input[position], (lua_Integer)position + 1);
+    else
+        lua_pushliteral(L, "required more bytes to decode messagepack");
+    return 2;
+}
+
+
+static int f_skip(lua_State *L) {
+    const uint8_t           *input;
+    size_t                  length, position;
+    lua_Integer             i, count;
+    int                     status;
+    STATS_BEGIN();
+
+    input = (const uint8_t*)check_data(L, 1, &length);
+    position = (size_t)luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, (position >= 1) && (position <= length + 1), 2, "invalid starting position");
+    --position;
+    count = luaL_optinteger(L, 3, 1);
+    luaL_argcheck(L, count >= 0, 3, "invalid count");
+
+    /* walk the headers, no Lua values are created */
+    for (i = 0; i < count; ++i) {
+        if ((status = msg_skip(input, length, &position)) <= 0) {
+            STATS_END(skip);
+            return skip_error(L, input, position, status);
+        }
+    }
+    lua_pushinteger(L, (lua_Integer)position + 1);
+    STATS_END(skip);
+    return 1;
+}
+
+
+static int f_index(lua_State *L) {
+    const uint8_t           *input;
+    size_t                  length, start, position, count, i;
+    index_t                 *index;
+    int                     status;
+    STATS_BEGIN();
+
+    input = (const uint8_t*)check_data(L, 1, &length);
+    start = (size_t)luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, (start >= 1) && (start <= length + 1), 2, "invalid starting position");
+    --start;
+
+    /* count all values to allocate the index with the exact size */
+    for (count = 0, position = start; position < length; ++count) {
+        if ((status = msg_skip(input, length, &position)) <= 0) {
+            STATS_END(index);
+            return skip_error(L, input, position, status);
+        }
+    }
+
+    index = (index_t*)lua_newuserdatauv(L, sizeof(index_t) + sizeof(size_t) * (count ? count - 1 : 0), 0);
+    index->count = count;
+    luaL_setmetatable(L, MSGPACK_INDEX);
+    for (i = 0, position = start; i < count; ++i) {
+        index->positions[i] = position + 1;
+        msg_skip(input, length, &position);
+    }
+    STATS_END(index);
+    return 1;
+}
+
+
+static int f_decode_all(lua_State *L) {
+    msg_t                   msg;
+    size_t                  position;
+    int                     items, status, i;
+    STATS_BEGIN();
+
+    msg.L = L;
+    msg.input = (const uint8_t*)check_data(L, 1, &msg.length);
+    msg.position = (size_t)luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, (msg.position >= 1) && (msg.position <= msg.length + 1), 2, "invalid starting position");
+    --msg.position;
+    msg.views = 0;
+    msg.keys = 0;
+    msg.depth = 0;
+
+    /* count all values to create a properly sized table */
+    for (items = 0, position = msg.position; position < msg.length; ++items) {
+        if ((status = msg_skip(msg.input, msg.length, &position)) <= 0) {
+            STATS_END(decode_all);
+            return skip_error(L, msg.input, position, status);
+        }
+    }
+
+    /* handle errors */
+    if (setjmp(msg.jmp)) {
+        STATS_END(decode_all);
+        return 2;
+    }
+
+    lua_createtable(L, items, 0);
+    for (i = 1; i <= items; ++i) {
+        msg_decode(&msg);
+        lua_rawseti(L, -2, i);
+    }
+    lua_pushinteger(L, items);
+    STATS_END(decode_all);
+    return 2;
+}
+
+
+static int f_to_json(lua_State *L) {
+    msg_t                   msg;
+    luaL_Buffer             buffer;
+    STATS_BEGIN();
+
     msg.L = L;
-    msg.input = (const uint8_t*)luaL_checklstring(L, 1, &msg.length);
+    msg.input = (const uint8_t*)check_data(L, 1, &msg.length);
     msg.position = (size_t)luaL_optinteger(L, 2, 1);
     luaL_argcheck(L, (msg.position >= 1) && (msg.position <= msg.length), 2, "invalid starting position");
     --msg.position;
-    count = (int)luaL_optinteger(L, 3, 1024 * 64);
+    msg.views = 0;
+    msg.keys = 0;
+    msg.depth = 0;
 
     /* handle errors */
-    if (setjmp(msg.jmp))
+    if (setjmp(msg.jmp)) {
+        STATS_END(to_json);
         return 2;
+    }
+
+    /* convert one value */
+    luaL_buffinit(L, &buffer);
+    json_write_value(&msg, &buffer);
+    luaL_pushresult(&buffer);
+    lua_pushinteger(L, msg.position + 1);
+    STATS_END(to_json);
+    return 2;
+}
+
+
+static void schema_encode(msg_t *msg, schema_t *schema) {
+    int                     i, items, record;
 
-    /* decode items */
+    if (lua_type(msg->L, -1) != LUA_TTABLE) {
+        msg_encode(msg);
+        return;
+    }
+    if (schema->array) {
+        /* positional records keep nil fields to preserve the order */
+        luaL_checkstack(msg->L, 2, "not enough stack space");
+        msg_write_array(msg, schema->count);
+        for (i = 0; i < schema->count; ++i) {
+            lua_getfield(msg->L, -1, schema->fields[i].key);
+            msg_encode(msg);
+        }
+    } else {
+        /* maps only contain the fields which are present, so all fields are fetched before the header */
+        luaL_checkstack(msg->L, schema->count + 2, "not enough stack space");
+        record = lua_gettop(msg->L);
+        for (i = items = 0; i < schema->count; ++i) {
+            if (lua_getfield(msg->L, record, schema->fields[i].key) != LUA_TNIL)
+                ++items;
+        }
+        msg_write_map(msg, items);
+        for (i = 0; i < schema->count; ++i) {
+            if (lua_isnil(msg->L, record + i + 1))
+                continue;
+            msg_write_str(msg, schema->fields[i].encoded, schema->fields[i].length);
+            lua_pushvalue(msg->L, record + i + 1);
+            msg_encode(msg);
+        }
+        lua_settop(msg->L, record);
+    }
+    lua_pop(msg->L, 1); /* pop record */
+}
+
+
+static void schema_decode(msg_t *msg, schema_t *schema) {
+    const uint8_t           *input = msg->input + msg->position;
+    size_t                  available = msg->length - msg->position;
+    uint64_t                payload, items;
+    int                     size, i, j, next;
+
+    size = msg_header(input, available, &payload, &items);
+    if ((size <= 0) || (*input < 0x80) || ((*input > 0x9f) && (*input < 0xdc)) || (*input > 0xdf)) {
+        msg_decode(msg); /* not a container, just decode it */
+        return;
+    }
+    luaL_checkstack(msg->L, 2, "too many values to unpack on stack");
+    msg->position += size;
+    if ((*input <= 0x8f) || (*input >= 0xde)) {
+        /* map: use the interned keys when they appear in schema order, absent fields are skipped */
+        items /= 2;
+        lua_createtable(msg->L, 0, (int)items);
+        for (i = next = 0; (uint64_t)i < items; ++i) {
+            for (j = next; j < schema->count; ++j) {
+                if ((schema->fields[j].length <= msg->length - msg->position) &&
+                    (memcmp(msg->input + msg->position, schema->fields[j].encoded, schema->fields[j].length) == 0))
+                    break;
+            }
+            if (j < schema->count) {
+                next = j + 1;
+                msg->position += schema->fields[j].length;
+                msg_decode(msg);
+                lua_setfield(msg->L, -2, schema->fields[j].key);
+            } else {
+                msg_decode(msg);
+                msg_decode(msg);
+                lua_rawset(msg->L, -3);
+            }
+        }
+    } else {
+        /* array: positional record */
+        if (items != (uint64_t)schema->count)
+            msg_error(msg, "record has %d fields but schema expects %d", (int)items, schema->count);
+        lua_createtable(msg->L, 0, schema->count);
+        for (i = 0; i < schema->count; ++i) {
+            msg_decode(msg);
+            lua_setfield(msg->L, -2, schema->fields[i].key);
+        }
+    }
+}
+
+
+static int f_schema(lua_State *L) {
+    schema_t                *schema;
+    msg_t                   msg;
+    size_t                  length;
+    int                     i, count;
+
+    lua_settop(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    count = (int)luaL_len(L, 1);
+    luaL_argcheck(L, count > 0, 1, "schema requires at least one field");
+    schema = (schema_t*)lua_newuserdatauv(L, sizeof(schema_t) + sizeof(field_t) * (count - 1), 1);
+    schema->count = count;
+    schema->array = 0;
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        lua_getfield(L, 2, "array");
+        schema->array = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    luaL_setmetatable(L, MSGPACK_SCHEMA);
+
+    /* the uservalue keeps key names and pre-encoded keys alive */
+    lua_createtable(L, count * 2, 0);
+    for (i = 0; i < count; ++i) {
+        lua_rawgeti(L, 1, i + 1);
+        if ((lua_type(L, -1) != LUA_TSTRING) || (strlen(lua_tolstring(L, -1, &length)) != length))
+            return luaL_argerror(L, 1, "field names must be strings without zeros");
+        schema->fields[i].key = lua_tostring(L, -1);
+        lua_rawseti(L, -2, i * 2 + 1);
+
+        msg_init_output(&msg, L);
+        if (setjmp(msg.jmp))
+            return lua_error(L);
+        lua_rawgeti(L, 1, i + 1);
+        msg_encode(&msg);
+        msg_pushresult(&msg);
+        schema->fields[i].encoded = (const uint8_t*)lua_tolstring(L, -1, &schema->fields[i].length);
+        lua_rawseti(L, -3, i * 2 + 2);
+        lua_pop(L, 1); /* pop output table */
+    }
+    lua_setiuservalue(L, -2, 1);
+    return 1;
+}
+
+
+static int f_schema_encode(lua_State *L) {
+    schema_t                *schema = (schema_t*)luaL_checkudata(L, 1, MSGPACK_SCHEMA);
+    int                     i, n;
+    msg_t                   msg;
+    STATS_BEGIN();
+
+    msg_init_output(&msg, L);
+    if (setjmp(msg.jmp)) {
+        STATS_END(encode);
+        return 2;
+    }
+    for (i = 2, n = lua_gettop(L); i < n; ++i) {
+        lua_pushvalue(L, i);
+        schema_encode(&msg, schema);
+    }
+    msg_pushresult(&msg);
+    STATS_END(encode);
+    return 1;
+}
+
+
+static int f_schema_decode(lua_State *L) {
+    schema_t                *schema = (schema_t*)luaL_checkudata(L, 1, MSGPACK_SCHEMA);
+    msg_t                   msg;
+    int                     items, count;
+    STATS_BEGIN();
+
+    msg.L = L;
+    msg.input = (const uint8_t*)check_data(L, 2, &msg.length);
+    msg.position = (size_t)luaL_optinteger(L, 3, 1);
+    luaL_argcheck(L, (msg.position >= 1) && (msg.position <= msg.length), 3, "invalid starting position");
+    --msg.position;
+    count = (int)luaL_optinteger(L, 4, 1024 * 64);
+    msg.views = 0;
+    msg.keys = 0;
+    msg.depth = 0;
+
+    STATS_ADD(bytes_in, -(lua_Integer)msg.position);
+    if (setjmp(msg.jmp)) {
+        STATS_ADD(bytes_in, msg.position);
+        STATS_END(decode);
+        return 2;
+    }
     for (items = 0; (items < count) && (msg.position < msg.length); ++items)
-        msg_decode(&msg);
+        schema_decode(&msg, schema);
     lua_pushinteger(L, msg.position + 1);
+    STATS_ADD(bytes_in, msg.position);
+    STATS_END(decode);
     return items + 1;
 }
 
 
+static int f_unpacker(lua_State *L) {
+    unpacker_t              *u;
+    int                     keys = 0;
+
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_getfield(L, 1, "keys");
+        keys = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    u = (unpacker_t*)lua_newuserdatauv(L, sizeof(unpacker_t), 1);
+    u->data = NULL;
+    u->size = u->start = u->length = u->scan = 0;
+    u->pending = 0;
+    u->keys = keys;
+    u->key_count = 0;
+    if (keys) {
+        lua_newtable(L);
+        lua_setiuservalue(L, -2, 1);
+    }
+    luaL_setmetatable(L, MSGPACK_UNPACKER);
+    return 1;
+}
+
+
+static int f_unpacker_feed(lua_State *L) {
+    unpacker_t              *u = (unpacker_t*)luaL_checkudata(L, 1, MSGPACK_UNPACKER);
+    size_t                  length, size;
+    const char              *chunk = luaL_checklstring(L, 2, &length);
+    uint8_t                 *data;
+    void                    *ud;
+    lua_Alloc               allocf;
+    STATS_BEGIN();
+
+    /* move unconsumed bytes to the front before growing the buffer */
+    if ((u->start > 0) && (u->length + length > u->size)) {
+        memmove(u->data, u->data + u->start, u->length - u->start);
+        u->length -= u->start;
+        u->scan -= u->start;
+        u->start = 0;
+    }
+    if (u->length + length > u->size) {
+        for (size = u->size ? u->size : 1024; size < u->length + length; size *= 2);
+        allocf = lua_getallocf(L, &ud);
+        if ((data = (uint8_t*)allocf(ud, u->data, u->size, size)) == NULL)
+            return luaL_error(L, "not enough memory"); /* the old buffer is still valid */
+        u->data = data;
+        u->size = size;
+    }
+    memcpy(u->data + u->length, chunk, length);
+    u->length += length;
+    STATS_ADD(bytes_in, length);
+    STATS_END(unpacker);
+    return 0;
+}
+
+
+/* releases the bytes of the value which was scanned last */
+static void unpacker_consume(unpacker_t *u) {
+    u->start = u->scan;
+    if (u->start >= u->length)
+        u->start = u->length = u->scan = 0;
+}
+
+
+static int f_unpacker_next(lua_State *L) {
+    unpacker_t              *u = (unpacker_t*)luaL_checkudata(L, 1, MSGPACK_UNPACKER);
+    msg_t                   msg;
+    uint64_t                payload, items;
+    int                     size;
+    STATS_BEGIN();
+
+    /* scan headers until the current value is complete */
+    if (u->pending == 0) {
+        if (u->scan >= u->length) {
+            lua_pushboolean(L, 0);
+            STATS_END(unpacker);
+            return 1;
+        }
+        u->pending = 1;
+    }
+    while (u->pending > 0) {
+        size = msg_header(u->data + u->scan, u->length - u->scan, &payload, &items);
+        if (size < 0) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "invalid messagepack code: %d", u->data[u->scan]);
+            STATS_END(unpacker);
+            return 2;
+        } else if ((size == 0) || (payload > u->length - u->scan - size)) {
+            lua_pushboolean(L, 0);
+            STATS_END(unpacker);
+            return 1;
+        }
+        u->scan += size + (size_t)payload;
+        u->pending += items - 1;
+    }
+
+    /* decode the complete value exactly once */
+    msg.L = L;
+    msg.input = u->data;
+    msg.position = u->start;
+    msg.length = u->scan;
+    msg.views = 0;
+    msg.keys = 0;
+    msg.depth = 0;
+    if (u->keys) {
+        /* ids of keys defined by a failed value are assigned again by the next definitions */
+        lua_getiuservalue(L, 1, 1);
+        msg.keys = lua_gettop(L);
+        msg.key_count = u->key_count;
+    }
+    lua_pushboolean(L, 1);
+    if (setjmp(msg.jmp)) {
+        unpacker_consume(u); /* drop the failed value, the stream continues with the next one */
+        STATS_END(unpacker);
+        return 2;
+    }
+    msg_decode(&msg);
+    u->key_count = msg.key_count;
+    unpacker_consume(u);
+    STATS_END(unpacker);
+    return 2;
+}
+
+
+static int f_packer(lua_State *L) {
+    packer_t                *p;
+    lua_Integer             max_keys = 4096;
+
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_getfield(L, 1, "max_keys");
+        max_keys = luaL_optinteger(L, -1, max_keys);
+        luaL_argcheck(L, (max_keys >= 0) && (max_keys <= MSGPACK_MAX_KEYS), 1, "max_keys must be 0..65536");
+        lua_pop(L, 1);
+    }
+    p = (packer_t*)lua_newuserdatauv(L, sizeof(packer_t), 1);
+    p->key_count = 0;
+    p->key_max = (int)max_keys;
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, 1);
+    luaL_setmetatable(L, MSGPACK_PACKER);
+    return 1;
+}
+
+
+static int f_packer_pack(lua_State *L) {
+    packer_t                *p = (packer_t*)luaL_checkudata(L, 1, MSGPACK_PACKER);
+    int                     i, n = lua_gettop(L);
+    msg_t                   msg;
+    STATS_BEGIN();
+
+    msg_init_output(&msg, L);
+    lua_getiuservalue(L, 1, 1);
+    msg.keys = lua_gettop(L);
+    msg.key_count = p->key_count;
+    msg.key_max = p->key_max;
+
+    /* the output is dropped on errors, so keys defined by it must be forgotten */
+    if (setjmp(msg.jmp)) {
+        lua_pushnil(L);
+        while (lua_next(L, n + 2)) {
+            if (lua_tointeger(L, -1) >= p->key_count) {
+                lua_pushvalue(L, -2);
+                lua_pushnil(L);
+                lua_rawset(L, n + 2);
+            }
+            lua_pop(L, 1);
+        }
+        STATS_END(encode);
+        return 2;
+    }
+    for (i = 2; i <= n; ++i) {
+        lua_pushvalue(L, i);
+        msg_encode(&msg);
+    }
+    p->key_count = msg.key_count;
+    n = msg_pushresult(&msg);
+    STATS_END(encode);
+    return n;
+}
+
+
+static int f_unpacker_gc(lua_State *L) {
+    unpacker_t              *u = (unpacker_t*)luaL_checkudata(L, 1, MSGPACK_UNPACKER);
+    void                    *ud;
+    lua_Alloc               allocf = lua_getallocf(L, &ud);
+    allocf(ud, u->data, u->size, 0);
+    u->data = NULL;
+    u->size = u->start = u->length = u->scan = 0;
+    return 0;
+}
+
+
+static int f_view_len(lua_State *L) {
+    view_t                  *view = (view_t*)luaL_checkudata(L, 1, MSGPACK_VIEW);
+    lua_pushinteger(L, (lua_Integer)view->length);
+    return 1;
+}
+
+
+static int f_view_tostring(lua_State *L) {
+    view_t                  *view = (view_t*)luaL_checkudata(L, 1, MSGPACK_VIEW);
+    lua_pushlstring(L, view->data, view->length);
+    return 1;
+}
+
+
+static int f_index_index(lua_State *L) {
+    index_t                 *index = (index_t*)luaL_checkudata(L, 1, MSGPACK_INDEX);
+    lua_Integer             i;
+    int                     isnum;
+
+    i = lua_tointegerx(L, 2, &isnum);
+    if (isnum && (i >= 1) && ((size_t)i <= index->count))
+        lua_pushinteger(L, (lua_Integer)index->positions[i - 1]);
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+
+static int f_index_len(lua_State *L) {
+    index_t                 *index = (index_t*)luaL_checkudata(L, 1, MSGPACK_INDEX);
+    lua_pushinteger(L, (lua_Integer)index->count);
+    return 1;
+}
+
+
+static const luaL_Reg       index_funcs[] = {
+    { "__index",            f_index_index   },
+    { "__len",              f_index_len     },
+    { NULL,                 NULL            }
+};
+
+
+static const luaL_Reg       view_funcs[] = {
+    { "__len",              f_view_len      },
+    { "__tostring",         f_view_tostring },
+    { NULL,                 NULL            }
+};
+
+
+static const luaL_Reg       schema_funcs[] = {
+    { "encode",             f_schema_encode },
+    { "decode",             f_schema_decode },
+    { "__index",            NULL            },
+    { NULL,                 NULL            }
+};
+
+
+static const luaL_Reg       packer_funcs[] = {
+    { "pack",               f_packer_pack   },
+    { "__index",            NULL            },
+    { NULL,                 NULL            }
+};
+
+
+static const luaL_Reg       unpacker_funcs[] = {
+    { "feed",               f_unpacker_feed },
+    { "next",               f_unpacker_next },
+    { "__gc",               f_unpacker_gc   },
+    { "__index",            NULL            },
+    { NULL,                 NULL            }
+};
+
+
 static const luaL_Reg       funcs[] = {
     { "encode",             f_encode        },
     { "decode",             f_decode        },
+    { "encode_with",        f_encode_with   },
+    { "sizeof",             f_sizeof        },
+    { "values",             f_values        },
+    { "decode_all",         f_decode_all    },
+    { "decode_file",        f_decode_file   },
+    { "skip",               f_skip          },
+    { "index",              f_index         },
+    { "to_json",            f_to_json       },
+    { "schema",             f_schema        },
+    { "unpacker",           f_unpacker      },
+    { "packer",             f_packer        },
+#ifdef MSGPACK_STATS
+    { "stats",              f_stats         },
+#endif
     { "_VERSION",           NULL            },
     { "_AUTHOR",            NULL            },
     { NULL,                 NULL            }
@@ -504,6 +2621,42 @@ static const luaL_Reg       funcs[] = {
 
 
 LUALIB_API int luaopen_msgpack(lua_State *L) {
+    luaL_newmetatable(L, MSGPACK_UNPACKER);
+    luaL_setfuncs(L, unpacker_funcs, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MSGPACK_PACKER);
+    luaL_setfuncs(L, packer_funcs, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MSGPACK_SCHEMA);
+    luaL_setfuncs(L, schema_funcs, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MSGPACK_VIEW);
+    luaL_setfuncs(L, view_funcs, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MSGPACK_INDEX);
+    luaL_setfuncs(L, index_funcs, 0);
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MSGPACK_FILE);
+    lua_pushcfunction(L, f_file_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MSGPACK_GC);
+    lua_pushcfunction(L, f_gc_close);
+    lua_setfield(L, -2, "__close");
+    lua_pop(L, 1);
+
     luaL_newlib(L, funcs);
     lua_pushstring(L, MSGPACK_VERSION);
     lua_setfield(L, -2, "_VERSION");
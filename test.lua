@@ -24,6 +24,31 @@ local function base64_test()
     test('Man', 'TWFu')
     test('Ma',  'TWE=')
     test('M',   'TQ==')
+
+    -- large buffers split into several jobs
+    do
+        local chars = {}
+        for i = 1, 1024 * 300 + 1 do chars[i] = string.char(i % 256) end
+        local data = table.concat(chars)
+        local a = base64.encode(data, 4)
+        assert(a == base64.encode(data))
+        assert(base64.decode(a, 4) == data)
+        local broken = a:sub(1, 300000) .. '?' .. a:sub(300002)
+        local ok, err = base64.decode(broken, 4)
+        assert(not ok and err:find('300001', 1, true))
+    end
+
+    -- statistics (only when compiled with BASE64_STATS)
+    if base64.stats then
+        base64.stats(true)
+        base64.encode('Man')
+        assert(not base64.decode('?'))
+        local stats = base64.stats()
+        assert(stats.encode_calls == 1 and stats.decode_calls == 1 and stats.errors == 1)
+        assert(stats.bytes_in == 4 and stats.bytes_out == 4)
+        assert(base64.stats().encode_calls == 1 and base64.stats(true).encode_calls == 1)
+        assert(base64.stats().encode_calls == 0)
+    end
 end
 
 
@@ -52,6 +77,64 @@ local function msgpack_test()
         end
     end
 
+    -- iterate / decode all values
+    do
+        local a = assert(msgpack.encode(1, 'two', nil, { 4 }, 5))
+        local positions, values = {}, {}
+        for position, value in msgpack.values(a) do
+            positions[#positions + 1] = position
+            values[#positions] = value
+        end
+        assert(#positions == 5 and positions[1] == 1 and positions[2] == 2)
+        assert(values[2] == 'two' and values[3] == nil and values[4][1] == 4 and values[5] == 5)
+        local t, n = assert(msgpack.decode_all(a))
+        assert(n == 5 and t[1] == 1 and t[3] == nil and t[5] == 5)
+        assert(not msgpack.decode_all(a:sub(1, -2) .. string.char(0xcd)))
+        local ok, err = msgpack.decode_all(string.char(0x01, 0x91, 0xc1))
+        assert(ok == nil and err == 'invalid messagepack code: 193 at position 3')
+        assert(not pcall(function() for _ in msgpack.values(string.char(0xc1)) do end end))
+    end
+
+    -- schema-compiled records
+    do
+        local schema = msgpack.schema({ 'id', 'ts', 'value' })
+        local a = assert(schema:encode({ id = 1, ts = 2, value = 'x' }, { id = 3, value = { 4 } }))
+        local b, c = schema:decode(a)
+        assert(b.id == 1 and b.ts == 2 and b.value == 'x')
+        assert(c.id == 3 and c.ts == nil and c.value[1] == 4)
+        assert(string.byte(assert(schema:encode({ id = 3, value = 4 }))) == 0x82)
+        assert(schema:decode(assert(schema:encode({ ts = 5 }))).ts == 5)
+        b = assert(msgpack.decode(a))
+        assert(b.id == 1 and b.value == 'x')
+        assert(schema:decode(assert(msgpack.encode({ value = 5, other = 6 }))).other == 6)
+
+        local positional = msgpack.schema({ 'id', 'ts', 'value' }, { array = true })
+        a = assert(positional:encode({ id = 1, ts = 2, value = 'x' }))
+        assert(string.byte(a) == 0x93)
+        b = positional:decode(a)
+        assert(b.id == 1 and b.ts == 2 and b.value == 'x')
+        assert(not positional:decode(assert(msgpack.encode({ 1, 2 }))))
+    end
+
+    -- statistics (only when compiled with MSGPACK_STATS)
+    if msgpack.stats then
+        msgpack.stats(true)
+        local a = assert(msgpack.encode({ { 'x' } }, string.char(255)))
+        assert(msgpack.decode(a))
+        local stats = msgpack.stats()
+        assert(stats.encode_calls == 1 and stats.decode_calls == 1)
+        assert(stats.str == 1 and stats.bin == 1 and stats.max_depth == 2)
+        assert(stats.bytes_out == #a and stats.bytes_in == #a)
+        assert(msgpack.skip(a) and msgpack.index(a) and msgpack.decode_all(a) and msgpack.to_json(a))
+        for _ in msgpack.values(a) do end
+        local u = msgpack.unpacker()
+        u:feed(a)
+        assert(u:next())
+        stats = msgpack.stats()
+        assert(stats.skip_calls == 1 and stats.index_calls == 1 and stats.decode_all_calls == 1)
+        assert(stats.to_json_calls == 1 and stats.values_calls == 3 and stats.unpacker_calls == 2)
+    end
+
     -- test string / binary encodings
     do
         -- fixstr
@@ -78,6 +161,254 @@ local function msgpack_test()
         test(0xc5, 2, 0xffff, string.char(255)) -- bin16
         test(0xc6, 4, 0x10000, string.char(255)) -- bin32
     end
+
+    -- streaming unpacker fed byte by byte
+    do
+        local a = assert(msgpack.encode(1, 'Hello', { 1, 2, 3 }, { foo = 'bar' }, nil, string.rep('x', 300)))
+        local u = msgpack.unpacker()
+        local values = {}
+        for i = 1, #a do
+            u:feed(a:sub(i, i))
+            local ok, value = u:next()
+            assert(ok ~= nil, value)
+            if ok then values[#values + 1] = value or 'nil' end
+        end
+        assert(u:next() == false)
+        assert(#values == 6)
+        assert(values[1] == 1 and values[2] == 'Hello')
+        assert(values[3][3] == 3 and values[4].foo == 'bar')
+        assert(values[5] == 'nil' and values[6] == string.rep('x', 300))
+        u:feed(string.char(0xc1))
+        local ok, err = u:next()
+        assert(ok == nil and err == 'invalid messagepack code: 193')
+
+        -- a value which fails to decode is dropped, the following one is still delivered
+        u = msgpack.unpacker()
+        u:feed(string.char(0xd4, 0x05, 0x00, 0x02))
+        ok, err = u:next()
+        assert(ok == nil and err == 'unsupported extension type: 5')
+        local value
+        ok, value = u:next()
+        assert(ok == true and value == 2 and u:next() == false)
+    end
+
+    -- deeply nested tables need more stack than a C function gets by default
+    do
+        local deep = { 'leaf' }
+        for i = 1, 100 do deep = { deep, key = i } end
+        local a = assert(msgpack.encode(deep))
+        assert(msgpack.sizeof(deep) == #a)
+        assert(msgpack.encode_with({ size = #a }, deep) == a)
+        local packed = assert(msgpack.packer():pack(deep))
+        local u = msgpack.unpacker({ keys = true })
+        u:feed(packed)
+        local ok, c = u:next()
+        assert(ok and c[1].key == 99)
+        local b = assert(msgpack.decode(a))
+        for _ = 1, 100 do b = b[1] end
+        assert(b[1] == 'leaf')
+    end
+
+    -- zero-copy views for large str / bin values
+    do
+        local json = require('json')
+        local base64 = require('base64')
+        local inner = assert(msgpack.encode(1, 2, 3, 'view'))
+        local doc = '{"foo":"bar"}'
+        local a = assert(msgpack.encode('tiny', inner, string.rep(string.char(255), 64), doc))
+        local small, b, c, d = msgpack.decode(a, 1, 4, { views = 8 })
+        assert(small == 'tiny')
+        assert(type(b) == 'userdata' and #b == #inner and tostring(b) == inner)
+        assert(#c == 64 and tostring(c) == string.rep(string.char(255), 64))
+        assert(select(3, msgpack.decode(b)) == 3)
+        assert(base64.encode(c) == base64.encode(string.rep(string.char(255), 64)))
+        assert(assert(json.decode(d)).foo == 'bar')
+        local e = assert(msgpack.decode(assert(msgpack.encode(b))))
+        assert(e == inner)
+    end
+
+    -- cooperative encode / decode inside coroutines
+    do
+        local data = { 1, 'two', { 3, { four = 4, list = {} } }, { a = { b = { c = 'd' } } } }
+        local steps = 0
+        local worker = coroutine.wrap(function() return msgpack.encode_with({ yield = 2 }, data, 'tail', {}) end)
+        local a = worker()
+        while a == nil do a, steps = worker(), steps + 1 end
+        assert(steps > 3 and a == assert(msgpack.encode(data, 'tail', {})))
+        steps = 0
+        worker = coroutine.wrap(function() return msgpack.decode(a, 1, nil, { yield = 1 }) end)
+        local results = table.pack(worker())
+        while results.n == 0 do results, steps = table.pack(worker()), steps + 1 end
+        assert(steps > 3 and results.n == 4 and results[4] == #a + 1)
+        assert(results[1][3][2].four == 4 and results[1][4].a.b.c == 'd' and results[2] == 'tail')
+        assert(msgpack.encode_with({ yield = 1 }, 1, 2) == msgpack.encode(1, 2)) -- not in a coroutine
+        worker = coroutine.wrap(function() return msgpack.decode(a:sub(1, 10), 1, nil, { yield = 1 }) end)
+        results = table.pack(worker())
+        while results.n == 0 do results = table.pack(worker()) end
+        assert(results[1] == nil and type(results[2]) == 'string')
+    end
+
+    -- direct conversion to JSON
+    do
+        local json = require('json')
+        local a = assert(msgpack.encode({ list = { 1, -200, 70000, 2.5, true, false }, text = 'a\n"b"', obj = { x = 'y' } }, 7))
+        local b, position = assert(msgpack.to_json(a))
+        local c = assert(json.decode(b))
+        assert(c.list[2] == -200 and c.list[3] == 70000 and c.list[4] == 2.5 and c.list[6] == false)
+        assert(c.text == 'a\n"b"' and c.obj.x == 'y')
+        assert(msgpack.to_json(a, position) == '7')
+        assert(msgpack.to_json(assert(msgpack.encode({ [1] = 'a', [3] = 'b' }))) == nil)
+        assert(msgpack.to_json(a:sub(1, 10)) == nil)
+    end
+
+    -- decoding files
+    do
+        local path = os.tmpname()
+        local file = assert(io.open(path, 'wb'))
+        file:write(assert(msgpack.encode(1, 'Hello', { 1, 2, 3 }, string.rep('x', 100))))
+        file:close()
+        local a, b, c, d, position = msgpack.decode_file(path)
+        assert(a == 1 and b == 'Hello' and c[3] == 3 and d == string.rep('x', 100))
+        local e = msgpack.decode_file(path, position - 102, 1)
+        assert(e == string.rep('x', 100))
+        local f = select(4, msgpack.decode_file(path, 1, nil, { views = 50 }))
+        collectgarbage()
+        assert(type(f) == 'userdata' and tostring(f) == string.rep('x', 100))
+        os.remove(path)
+        assert(msgpack.decode_file(path) == nil)
+    end
+
+    -- skipping and indexing values
+    do
+        local a = assert(msgpack.encode(1, { 2, { 3, 'four' } }, { five = 5 }, string.rep('x', 300), nil))
+        local index = assert(msgpack.index(a))
+        assert(#index == 5 and index[1] == 1 and index[6] == nil)
+        assert(msgpack.skip(a, 1, 2) == index[3] and msgpack.skip(a) == index[2] and msgpack.skip(a, 1, 5) == #a + 1)
+        assert(msgpack.decode(a, index[4], 1) == string.rep('x', 300))
+        assert(msgpack.decode(a, index[3], 1).five == 5)
+        assert(msgpack.skip(a, 1, 6) == nil)
+        assert(msgpack.index(a:sub(1, -5)) == nil)
+        assert(#assert(msgpack.index('')) == 0)
+    end
+
+    -- base64 encoding option
+    do
+        local base64 = require('base64')
+        local big = string.rep('0123456789', 2000)
+        for _, values in ipairs({ { 1 }, { 1, 2 }, { 'Hello', { 1, 2, 3 } }, { big, { big } } }) do
+            local a = assert(msgpack.encode_with({ encoding = 'base64' }, table.unpack(values)))
+            assert(a == base64.encode(assert(msgpack.encode(table.unpack(values)))))
+            local b = { msgpack.decode(a, nil, nil, { encoding = 'base64' }) }
+            assert(#b == #values + 1 and b[1] == values[1])
+        end
+        local a = assert(msgpack.encode_with({ encoding = 'base64' }, 'view', big))
+        local v, w = msgpack.decode(a, 1, 2, { encoding = 'base64', views = 100 })
+        msgpack.decode(base64.encode(msgpack.encode(1)), nil, nil, { encoding = 'base64' })
+        assert(v == 'view' and tostring(w) == big)
+        local b, err = msgpack.decode('kw*=', nil, nil, { encoding = 'base64' })
+        assert(b == nil and err:find('position 3'))
+    end
+
+    -- hash option
+    do
+        local function crc32c(str)
+            local crc = 0xFFFFFFFF
+            for i = 1, #str do
+                crc = crc ~ str:byte(i)
+                for _ = 1, 8 do crc = (crc >> 1) ~ ((crc & 1) * 0x82F63B78) end
+            end
+            return string.format('%08x', crc ~ 0xFFFFFFFF)
+        end
+        local big = { string.rep('0123456789', 3000), { 1, 2, 3 } }
+        assert(select(2, msgpack.encode_with({ hash = 'xxh64' })) == 'ef46db3751d8e999')
+        local a, digest = msgpack.encode_with({ hash = 'crc32c' }, 1, 'Hello', big)
+        assert(a == msgpack.encode(1, 'Hello', big) and digest == crc32c(a))
+        local b, digest2 = msgpack.encode_with({ hash = 'crc32c', encoding = 'base64' }, 1, 'Hello', big)
+        assert(digest2 == digest and msgpack.decode(b, nil, nil, { encoding = 'base64' }) == 1)
+        local c, digest3 = msgpack.encode_with({ hash = 'xxh64' }, big)
+        local worker = coroutine.wrap(function() return msgpack.encode_with({ hash = 'xxh64', yield = 1 }, big) end)
+        local d, digest4 = worker()
+        while d == nil do d, digest4 = worker() end
+        assert(c == d and #digest3 == 16 and digest3 == digest4)
+        assert(not pcall(msgpack.encode_with, { hash = 'md5' }, 1))
+    end
+
+    -- precomputed sizes
+    do
+        local big = {}
+        for i = 1, 70000 do big[i] = i end
+        local values = {
+            table.pack(nil, true, 0, 127, 128, 255, 256, 65535, 65536, 4294967295, 4294967296, -1, -32, -33, -128, -129, -32768, -32769, -2147483648, -2147483649),
+            table.pack(0.5, 0.1, '', string.rep('a', 31), string.rep('a', 32), string.rep('a', 256), string.rep('a', 65536), '\xff', string.rep('\xff', 256)),
+            table.pack({ list = { 1, 2, 3 }, map = { a = 1, [true] = false } }, big, { nested = { { { {} } } } }),
+        }
+        for _, v in ipairs(values) do
+            local size = assert(msgpack.sizeof(table.unpack(v, 1, v.n)))
+            local a = assert(msgpack.encode(table.unpack(v, 1, v.n)))
+            assert(size == #a)
+            assert(msgpack.encode_with({ size = size }, table.unpack(v, 1, v.n)) == a)
+        end
+        assert(msgpack.sizeof() == 0 and msgpack.encode_with({ size = 0 }) == '')
+        local a, err = msgpack.encode_with({ size = 4 }, 1234)
+        assert(a == nil and err:find('differs'))
+        a, err = msgpack.encode_with({ size = 2 }, string.rep('x', 20000))
+        assert(a == nil and err:find('exceeds'))
+        assert(msgpack.sizeof(1, print) == nil)
+        assert(not pcall(msgpack.encode_with, { size = 1, encoding = 'base64' }, 1))
+    end
+
+    -- pausing the collector while decoding
+    do
+        local big = {}
+        for i = 1, 10000 do big[i] = { id = i, name = 'item' .. i } end
+        local binary = assert(msgpack.encode(big))
+        local a = assert(msgpack.decode(binary, nil, nil, { gc = 'pause' }))
+        assert(#a == 10000 and a[10000].name == 'item10000' and collectgarbage('isrunning'))
+        assert(msgpack.decode(binary:sub(1, -2), nil, nil, { gc = 'pause' }) == nil and collectgarbage('isrunning'))
+        assert(not pcall(msgpack.decode, string.rep('\xc0', 2000000), 1, 2000000, { gc = 'pause' }))
+        assert(collectgarbage('isrunning'))
+        collectgarbage('stop')
+        assert(msgpack.decode(binary, nil, nil, { gc = 'pause' }) and not collectgarbage('isrunning'))
+        collectgarbage('restart')
+        assert(not pcall(msgpack.decode, binary, nil, nil, { gc = 'off' }))
+    end
+
+    -- key dictionary of packer / unpacker pairs
+    do
+        local packer, unpacker = msgpack.packer(), msgpack.unpacker({ keys = true })
+        local message = { id = 1, name = 'first', nested = { name = 'inner', list = { { id = 2 } } } }
+        local a = assert(packer:pack(message))
+        local b = assert(packer:pack(message, { name = 'second', extra = true }))
+        assert(#b < #a * 2 and #assert(packer:pack(message)) < #a and #a > #msgpack.encode(message))
+        unpacker:feed(a)
+        unpacker:feed(b:sub(1, 5))
+        local ok, value = assert(unpacker:next())
+        assert(ok and value.name == 'first' and value.nested.name == 'inner' and value.nested.list[1].id == 2)
+        assert(unpacker:next() == false)
+        unpacker:feed(b:sub(6))
+        ok, value = assert(unpacker:next())
+        assert(ok and value.nested.name == 'inner')
+        ok, value = assert(unpacker:next())
+        assert(ok and value.name == 'second' and value.extra == true)
+
+        -- failed values do not define keys, limits are respected
+        assert(packer:pack({ unknown = print }) == nil)
+        local c = assert(packer:pack({ unknown = 1 }))
+        unpacker:feed(c)
+        ok, value = assert(unpacker:next())
+        assert(ok and value.unknown == 1)
+        local small = msgpack.packer({ max_keys = 1 })
+        local d = assert(small:pack({ first = 1 }, { second = 2 }, { first = 3, second = 4 }))
+        local other = msgpack.unpacker({ keys = true })
+        other:feed(d)
+        assert(select(2, other:next()).first == 1 and select(2, other:next()).second == 2)
+        value = select(2, other:next())
+        assert(value.first == 3 and value.second == 4)
+        assert(msgpack.decode(a) == nil and msgpack.unpacker():next() == false)
+        local plain = msgpack.unpacker()
+        plain:feed(a)
+        assert(plain:next() == nil)
+    end
 end
 
 
@@ -88,6 +419,172 @@ local function json_test()
     for k,v in pairs(assert(json.decode('{"str":"Hello World!","obj":{"test":"Test!"},"int":1,"pi":3.1415926535898,"array":[1,2,3]}'))) do
         print(k, v)
     end
+
+    -- statistics (only when compiled with JSON_STATS)
+    if json.stats then
+        json.stats(true)
+        local a = assert(json.encode({ 'a\n"b"' }))
+        assert(json.decode(a))
+        local stats = json.stats()
+        assert(stats.encode_calls == 1 and stats.decode_calls == 1)
+        assert(stats.escaped == 3 and stats.max_depth == 1 and stats.bytes_in == #a)
+        assert(json.decode_many({ a }) and json.to_msgpack(a))
+        stats = json.stats()
+        assert(stats.decode_many_calls == 1 and stats.to_msgpack_calls == 1 and stats.bytes_in == #a * 3)
+    end
+
+    -- batch decoding
+    do
+        local documents = { '[1, 2, 3]', '{"a": "b\\n", "c": [true, false, null]}', '[1,]', '"plain"' }
+        for i = 5, 100 do documents[i] = string.format('{"id": %d}', i) end
+        local values, errors = json.decode_many(documents, 4)
+        assert(values[1][3] == 3 and values[2].a == 'b\n' and values[2].c[2] == false)
+        assert(values[3] == nil and errors[3] and not errors[1])
+        assert(values[4] == 'plain' and values[100].id == 100)
+    end
+
+    -- signed numbers
+    assert(json.decode('-1.5') == -1.5)
+    assert(json.decode('[1e+2]')[1] == 100)
+
+    -- cooperative encode / decode inside coroutines
+    do
+        local data = { list = { 1, 2, { 3 } }, obj = { a = 'b', c = {} }, str = 'x' }
+        local steps = 0
+        local worker = coroutine.wrap(function() return json.encode(data, { yield = 1 }) end)
+        local a = worker()
+        while a == nil do a, steps = worker(), steps + 1 end
+        assert(steps > 3 and #a == #assert(json.encode(data)))
+        steps = 0
+        worker = coroutine.wrap(function() return json.decode(a, { yield = 1 }) end)
+        local b = worker()
+        while b == nil do b, steps = worker(), steps + 1 end
+        assert(steps > 3 and b.list[3][1] == 3 and b.obj.a == 'b' and next(b.obj.c) == nil and b.str == 'x')
+        worker = coroutine.wrap(function() return json.decode('[1, 2,]', { yield = 1 }) end)
+        local c, err = worker()
+        while c == nil and err == nil do c, err = worker() end
+        assert(c == nil and type(err) == 'string')
+    end
+
+    -- direct conversion to messagepack
+    do
+        local msgpack = require('msgpack')
+        local doc = '{"list": [1, -200, 70000, 2.5, 1e2, true, null], "text": "a\\n", "obj": {"x": "y"}}'
+        local a = assert(json.to_msgpack(doc))
+        local b = assert(msgpack.decode(a))
+        assert(b.list[1] == 1 and math.type(b.list[3]) == 'integer' and b.list[4] == 2.5 and b.list[5] == 100.0)
+        assert(b.list[6] == true and b.text == 'a\n' and b.obj.x == 'y')
+        assert(json.to_msgpack('[1, 2') == nil)
+        assert(json.to_msgpack('[1, 2, 3]') == msgpack.encode({ 1, 2, 3 }))
+        assert(json.to_msgpack('"\255"') == msgpack.encode('\255') and json.to_msgpack('"\195\191"') == msgpack.encode('\195\191'))
+        assert(json.decode((assert(msgpack.to_json(a)))).list[2] == -200)
+    end
+
+    -- decoding files
+    do
+        local path = os.tmpname()
+        local file = assert(io.open(path, 'wb'))
+        file:write('{"list": [1, 2, 3], "str": "Hello"}')
+        file:close()
+        local a = assert(json.decode_file(path))
+        assert(a.list[3] == 3 and a.str == 'Hello')
+        file = assert(io.open(path, 'wb'))
+        file:write('[1, 2')
+        file:close()
+        assert(json.decode_file(path) == nil)
+        os.remove(path)
+        assert(json.decode_file(path) == nil)
+    end
+
+    -- packed numeric arrays
+    do
+        local doc = '{"coordinates": [[[1.5, -2], [3e2, 4]], []], "mixed": [1, "x"]}'
+        local a = assert(json.decode(doc, { numeric_arrays = 'f64' }))
+        local p = a.coordinates[1][1]
+        assert(type(p) == 'userdata' and #p == 2 and p[1] == 1.5 and p[2] == -2 and p[3] == nil)
+        assert(a.coordinates[1][2][1] == 300 and type(a.coordinates[2]) == 'table' and a.mixed[2] == 'x')
+        assert(json.encode(p) == '[1.5,-2.0]')
+        assert(json.encode(a.coordinates[1]) == '[[1.5,-2.0],[300.0,4.0]]')
+        assert(json.decode('[1, 2,]', { numeric_arrays = 'f64' }) == nil)
+        assert(json.decode('[1, -]', { numeric_arrays = 'f64' }) == nil)
+        -- numbers do not depend on the decimal point of the locale
+        if os.setlocale('de_DE.UTF-8', 'numeric') or os.setlocale('de_DE', 'numeric') then
+            local ok, b = pcall(json.decode, '[1.5, 2]', { numeric_arrays = 'f64' })
+            local c = json.decode_many({ '[1.5]' })
+            os.setlocale('C', 'numeric')
+            assert(ok and b[1] == 1.5 and c[1][1] == 1.5)
+        end
+    end
+
+    -- small documents use the table driven decoder, results must match the regular decoder
+    do
+        local padding = string.rep(' ', 600)
+        local docs = {
+            ' {"id": 1, "op": "get", "list": [1, -2.5, 3e2, true, false, null], "obj": {}} ',
+            '"esc\\"aped\\n\\t\\/"', '[[], [[]], {"a": {"b": [1]}}]', '\r\n\t-0',
+        }
+        for _, doc in ipairs(docs) do
+            assert(json.encode(assert(json.decode(doc))) == json.encode(assert(json.decode(padding .. doc))))
+        end
+        assert(math.type(json.decode('[1]')[1]) == 'float' and math.type(json.decode(padding .. '[1]')[1]) == 'float')
+        assert(math.type(json.decode('1')) == 'float' and math.type(json.decode(padding .. '1')) == 'float')
+        for _, doc in ipairs({ '[1, 2', '{"a" 1}', '[1,]', '"\\x"', 'nul', '', '{"a": [1, 2}', '[1 2]' }) do
+            local a, err1 = json.decode(doc)
+            local b, err2 = json.decode(padding .. doc)
+            assert(a == nil and b == nil and err1 == err2, doc)
+        end
+    end
+
+    -- base64 encoding option
+    do
+        local base64 = require('base64')
+        local big = { string.rep('0123456789', 2000), { 1, 2, 3 } }
+        for _, value in ipairs({ 1, 'a', { 1, 2 }, { a = 'b' }, big }) do
+            local a = assert(json.encode(value, { encoding = 'base64' }))
+            assert(a == base64.encode(assert(json.encode(value))))
+            assert(json.encode(assert(json.decode(a, { encoding = 'base64' }))) == json.encode(assert(json.decode(json.encode(value)))))
+        end
+        local a, err = json.decode('WzFd!', { encoding = 'base64' })
+        assert(a == nil and err:find('position 5'))
+    end
+
+    -- hash option
+    do
+        local function crc32c(str)
+            local crc = 0xFFFFFFFF
+            for i = 1, #str do
+                crc = crc ~ str:byte(i)
+                for _ = 1, 8 do crc = (crc >> 1) ~ ((crc & 1) * 0x82F63B78) end
+            end
+            return string.format('%08x', crc ~ 0xFFFFFFFF)
+        end
+        local big = { string.rep('0123456789', 3000), { 1, 2, 3 } }
+        local a, digest = json.encode(big, { hash = 'crc32c' })
+        assert(a == json.encode(big) and digest == crc32c(a))
+        assert(select(2, json.encode(big, { hash = 'crc32c', encoding = 'base64' })) == digest)
+        local b, digest2 = json.encode(big, { hash = 'xxh64' })
+        local worker = coroutine.wrap(function() return json.encode(big, { hash = 'xxh64', yield = 1 }) end)
+        local c, digest3 = worker()
+        while c == nil do c, digest3 = worker() end
+        assert(b == c and #digest2 == 16 and digest2 == digest3)
+        assert(select(2, json.encode(1, { hash = 'xxh64' })) ~= select(2, json.encode(2, { hash = 'xxh64' })))
+        assert(not pcall(json.encode, 1, { hash = 'md5' }))
+    end
+
+    -- pausing the collector while decoding
+    do
+        local big = {}
+        for i = 1, 10000 do big[i] = { id = i, name = 'item' .. i } end
+        local doc = assert(json.encode(big))
+        local a = assert(json.decode(doc, { gc = 'pause' }))
+        assert(#a == 10000 and a[10000].name == 'item10000' and collectgarbage('isrunning'))
+        assert(json.decode(doc:sub(1, -2), { gc = 'pause' }) == nil and collectgarbage('isrunning'))
+        assert(json.decode('[1]', { gc = 'pause' })[1] == 1 and collectgarbage('isrunning'))
+        collectgarbage('stop')
+        assert(json.decode(doc, { gc = 'pause' }) and not collectgarbage('isrunning'))
+        collectgarbage('restart')
+        assert(not pcall(json.decode, doc, { gc = 'off' }))
+    end
 end
 
 